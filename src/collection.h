@@ -127,7 +127,7 @@ struct Vector
 
     T &insert(int i, const T &e)
     {
-        add();
+        add(e);
         for(int p = len-1; p>i; p--) buf[p] = buf[p-1];
         buf[i] = e;
         return buf[i];
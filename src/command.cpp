@@ -48,7 +48,7 @@ char *path(const char *s, bool copy)
     return tmp;
 }
 
-char *loadfile(const char *fn)
+char *loadfile(const char *fn, int *size)
 {
     FILE *f = fopen(fn, "rb");
     if(!f) return NULL;
@@ -66,6 +66,7 @@ char *loadfile(const char *fn)
         delete[] buf;
         return NULL;
     }
+    if(size) *size = len;
     return buf;
 }
 
@@ -597,9 +598,10 @@ void intret(int v) { defprintstring(b)("%d", v); commandret = newstring(b); }
 const char *floatstr(float v)
 {
     static int n = 0;
-    static String t[3];
-    n = (n + 1)%3;
-    printstring(t[n])(v==int(v) ? "%.1f" : "%.7g", v);
+    static String t[16];
+    n = (n + 1)%16;
+    int len = ftoa(t[n], v);
+    if(v==int(v) && !strchr(t[n], 'e')) strcpy(&t[n][len], ".0");
     return t[n];
 }
 
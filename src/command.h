@@ -83,10 +83,12 @@ struct ident
     virtual void changed() { if(fun) fun(); }
 };
 
+extern char *path(char *s);
 extern char *path(const char *s, bool copy);
-extern char *loadfile(const char *fn);
+extern char *loadfile(const char *fn, int *size = NULL);
 extern void addident(const char *name, ident *id);
 extern void intret(int v);
+extern int ftoa(char *buf, float v);
 extern const char *floatstr(float v);
 extern void floatret(float v);
 extern void result(const char *s);
@@ -1,23 +1,56 @@
 #include "engine.h"
 
-struct cline { char *line; int type, outtime; };
-Vector<cline> conlines;
+struct cline { String line; int type, outtime; };
+
+// fixed-capacity ring of console lines, indexed from the newest
+struct conbuffer
+{
+    cline *lines;
+    int capacity, newest, len;
+
+    conbuffer() : lines(NULL), capacity(0), newest(0), len(0) {}
+    ~conbuffer() { delete[] lines; }
+
+    int size() const { return len; }
+    bool inrange(int i) const { return i >= 0 && i < len; }
+    cline &operator[](int i) { return lines[(newest + i) % capacity]; }
+
+    void setcapacity(int n)
+    {
+        cline *newlines = new cline[n];
+        int keep = min(len, n);
+        loopi(keep) memcpy(&newlines[i], &(*this)[i], sizeof(cline));
+        delete[] lines;
+        lines = newlines;
+        capacity = n;
+        newest = 0;
+        len = keep;
+    }
+
+    cline &add()
+    {
+        newest = (newest + capacity - 1) % capacity;
+        if(len < capacity) len++;
+        return lines[newest];
+    }
+};
+conbuffer conlines;
 
 bool saycommandon = false;
 String commandbuf;
 char *commandaction = NULL, *commandprompt = NULL;
 int commandpos = -1;
 
-VARF(maxcon, 10, 200, 1000, { while(conlines.size() > maxcon) delete[] conlines.pop().line; });
+VARF(maxcon, 10, 200, 1000, { if(conlines.capacity) conlines.setcapacity(maxcon); });
 
 void conline(int type, const char *sf)        // add a line to the console buffer
 {
-    cline cl;
-    cl.line = conlines.size()>maxcon ? conlines.pop().line : newstringbuf("");   // constrain the buffer size
+    if(!conlines.capacity) conlines.setcapacity(maxcon);
+    cline &cl = conlines.add();                    // overwrites the oldest line once full
     cl.type = type;
     cl.outtime = lastmillis;                       // for how long to keep line on screen
-    conlines.insert(0, cl);
     copystring(cl.line, sf);
+    requestredraw();
 }
 
 #define CONSPAD (FONTH/3)
@@ -39,13 +72,42 @@ void filtertext(char *dst, const char *src, bool whitespace = true, int len = MA
     *dst = '\0';
 }
 
+// lines printed from worker threads wait here until the main thread flushes them into the console
+struct pendingline { String line; int type; };
+static Vector<pendingline> pendinglines;
+static SDL_mutex *conlock = NULL;
+static Uint32 conthread = 0;
+
+void initconsole()
+{
+    if(!conlock) conlock = SDL_CreateMutex();
+    conthread = SDL_ThreadID();
+}
+
+void flushconsole()
+{
+    if(!conlock) return;
+    SDL_mutexP(conlock);
+    loopv(pendinglines) conline(pendinglines[i].type, pendinglines[i].line);
+    pendinglines.setsize(0);
+    SDL_mutexV(conlock);
+}
+
 void conoutfv(int type, const char *fmt, va_list args)
 {
     String sf, sp;
     formatstring(sf, fmt, args);
     filtertext(sp, sf);
     puts(sp);
-    conline(type, sf);
+    if(conlock && SDL_ThreadID() != conthread)
+    {
+        SDL_mutexP(conlock);
+        pendingline &p = pendinglines.add();
+        copystring(p.line, sf);
+        p.type = type;
+        SDL_mutexV(conlock);
+    }
+    else conline(type, sf);
 }
 
 void conoutf(const char *fmt, ...)
@@ -64,6 +126,53 @@ void conoutf(int type, const char *fmt, ...)
     va_end(args);
 }
 
+struct diagcategory
+{
+    String name;
+    int count;
+    Vector<char *> examples;
+
+    ~diagcategory() { loopv(examples) delete[] examples[i]; }
+};
+
+VAR(diagverbosity, 0, 1, 2);
+VAR(diagexamples, 0, 3, 100);
+
+void DiagLog::add(const char *category, const char *fmt, ...)
+{
+    diagcategory *d = NULL;
+    loopv(categories) if(!strcmp(categories[i]->name, category)) { d = categories[i]; break; }
+    if(!d)
+    {
+        d = categories.add(new diagcategory);
+        copystring(d->name, category);
+        d->count = 0;
+    }
+    d->count++;
+    if(diagverbosity >= 2 || (diagverbosity && d->examples.size() < diagexamples))
+    {
+        defprintstringlv(sf, fmt, fmt);
+        d->examples.add(newstring(sf));
+    }
+}
+
+void DiagLog::flush()
+{
+    loopv(categories)
+    {
+        diagcategory *d = categories[i];
+        conoutf(CON_WARN, "%s: %d %s", context, d->count, d->name);
+        loopvj(d->examples) conoutf(CON_WARN, "    %s", d->examples[j]);
+        if(d->examples.size() && d->count > d->examples.size()) conoutf(CON_WARN, "    ... %d more", d->count - d->examples.size());
+    }
+    clear();
+}
+
+void DiagLog::clear()
+{
+    while(categories.size()) delete categories.pop();
+}
+
 int rendercommand(int x, int y, int w)
 {
     if(!saycommandon) return 0;
@@ -115,7 +224,7 @@ int renderconsole(int w, int h)                   // render buffer taking into a
         if(!conskip) 
         {
             numl = 0;
-            loopvrev(conlines) if(lastmillis-conlines[i].outtime < confade*1000) { numl = i+1; break; }
+            looprevi(conlines.size()) if(lastmillis-conlines[i].outtime < confade*1000) { numl = i+1; break; }
         } 
         else offset--;
     }
@@ -146,6 +255,20 @@ int renderconsole(int w, int h)                   // render buffer taking into a
     return (y+CONSPAD+FONTH/3);
 }
 
+int consolewake()                                 // millis until the console changes without input, or -1 if it won't
+{
+    if(saycommandon) return 250 - lastmillis%250; // cursor blink
+    if(!confade || conskip) return -1;
+    int wake = -1;
+    loopv(conlines)                                // newest first, so the last line still visible expires soonest
+    {
+        int left = conlines[i].outtime + confade*1000 - lastmillis;
+        if(left <= 0) break;
+        wake = left;
+    }
+    return wake;
+}
+
 // keymap is defined externally in keymap.cfg
 
 struct keym
@@ -28,6 +28,15 @@
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
 #include "windows.h"
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __FMA__
+#include <immintrin.h>
 #endif
 
 #include <SDL.h>
@@ -64,6 +73,10 @@ extern bool setfont(const char *name);
 extern void gettextres(int &w, int &h);
 extern void draw_text(const char *str, int left, int top, int r = 255, int g = 255, int b = 255, int a = 255, int cursor = -1, int maxwidth = -1);
 extern void draw_textf(const char *fstr, int left, int top, ...);
+extern void begintextbatch();
+extern void endtextbatch();
+extern void settextxform(const Vec3 &origin, const Vec3 &xaxis, const Vec3 &yaxis);
+extern void resettextxform();
 extern int text_width(const char *str);
 extern void text_bounds(const char *str, int &width, int &height, int maxwidth = -1);
 extern int text_visible(const char *str, int hitx, int hity, int maxwidth);
@@ -84,11 +97,66 @@ extern const char *addreleaseaction(const char *s);
 extern void keypress(int code, bool isdown, int cooked);
 extern int rendercommand(int x, int y, int w);
 extern int renderconsole(int w, int h);
+extern int consolewake();
+extern void initconsole();
+extern void flushconsole();
 extern void conoutf(const char *s, ...);
 extern void conoutf(int type, const char *s, ...);
 
+// aggregates repeated warnings from a batch operation into per-category counts with a few examples;
+// every operation owns its log, so a model read on a worker thread never mixes with the main thread
+struct diagcategory;
+struct DiagLog
+{
+    String context;
+    Vector<diagcategory *> categories;
+
+    DiagLog() { context[0] = '\0'; }
+    ~DiagLog() { clear(); }
+
+    void begin(const char *ctx) { clear(); copystring(context, ctx); }
+    void add(const char *category, const char *fmt, ...);
+    void flush();
+    void clear();
+};
+
 extern int lastmillis;
 
+enum
+{
+    PROF_FRAME = 0,
+    PROF_INPUT,
+    PROF_HOVER,
+    PROF_ANIMATE,
+    PROF_MAPJOINTS,
+    PROF_SKINNING,
+    PROF_SPHERES,
+    PROF_JOINTS,
+    PROF_CONSTRAINTS,
+    PROF_CONSOLE,
+    PROF_NUM
+};
+
+extern ullong proftime();
+extern void profbeginframe();
+extern void profendframe();
+extern void profdiscardframe();
+extern void profbegin(int phase);
+extern void profend(int phase);
+extern void renderprofile(int x, int y);
+
+struct profscope
+{
+    int phase;
+
+    profscope(int phase) : phase(phase) { profbegin(phase); }
+    ~profscope() { profend(phase); }
+};
+
+#define PROFILE(phase) profscope prof_##phase(phase)
+
+extern void requestredraw();
+
 extern void fatal(const char *fmt, ...);
 
 #endif
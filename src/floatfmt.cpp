@@ -0,0 +1,226 @@
+#include "engine.h"
+
+// shortest round-trip float to decimal conversion, after Ulf Adams' Ryu (PLDI 2018)
+
+#define FLOATMANTBITS 23
+#define FLOATEXPBITS 8
+#define FLOATBIAS 127
+#define POW5INVBITS 59
+#define POW5BITS 61
+
+static const ullong pow5invsplit[31] =
+{
+    576460752303423489ULL, 461168601842738791ULL, 368934881474191033ULL,
+    295147905179352826ULL, 472236648286964522ULL, 377789318629571618ULL,
+    302231454903657294ULL, 483570327845851670ULL, 386856262276681336ULL,
+    309485009821345069ULL, 495176015714152110ULL, 396140812571321688ULL,
+    316912650057057351ULL, 507060240091291761ULL, 405648192073033409ULL,
+    324518553658426727ULL, 519229685853482763ULL, 415383748682786211ULL,
+    332306998946228969ULL, 531691198313966350ULL, 425352958651173080ULL,
+    340282366920938464ULL, 544451787073501542ULL, 435561429658801234ULL,
+    348449143727040987ULL, 557518629963265579ULL, 446014903970612463ULL,
+    356811923176489971ULL, 570899077082383953ULL, 456719261665907162ULL,
+    365375409332725730ULL
+};
+
+static const ullong pow5split[47] =
+{
+    1152921504606846976ULL, 1441151880758558720ULL, 1801439850948198400ULL,
+    2251799813685248000ULL, 1407374883553280000ULL, 1759218604441600000ULL,
+    2199023255552000000ULL, 1374389534720000000ULL, 1717986918400000000ULL,
+    2147483648000000000ULL, 1342177280000000000ULL, 1677721600000000000ULL,
+    2097152000000000000ULL, 1310720000000000000ULL, 1638400000000000000ULL,
+    2048000000000000000ULL, 1280000000000000000ULL, 1600000000000000000ULL,
+    2000000000000000000ULL, 1250000000000000000ULL, 1562500000000000000ULL,
+    1953125000000000000ULL, 1220703125000000000ULL, 1525878906250000000ULL,
+    1907348632812500000ULL, 1192092895507812500ULL, 1490116119384765625ULL,
+    1862645149230957031ULL, 1164153218269348144ULL, 1455191522836685180ULL,
+    1818989403545856475ULL, 2273736754432320594ULL, 1421085471520200371ULL,
+    1776356839400250464ULL, 2220446049250313080ULL, 1387778780781445675ULL,
+    1734723475976807094ULL, 2168404344971008868ULL, 1355252715606880542ULL,
+    1694065894508600678ULL, 2117582368135750847ULL, 1323488980084844279ULL,
+    1654361225106055349ULL, 2067951531382569187ULL, 1292469707114105741ULL,
+    1615587133892632177ULL, 2019483917365790221ULL
+};
+
+static inline int pow5bits(int e) { return int(((uint)e * 1217359) >> 19) + 1; }
+static inline int log10pow2(int e) { return int(((uint)e * 78913) >> 18); }
+static inline int log10pow5(int e) { return int(((uint)e * 732923) >> 20); }
+
+static inline int pow5factor(uint v)
+{
+    int count = 0;
+    for(; v%5 == 0; v /= 5) count++;
+    return count;
+}
+
+static inline bool multipleofpow5(uint v, int p) { return pow5factor(v) >= p; }
+static inline bool multipleofpow2(uint v, int p) { return (v & ((1u << p) - 1)) == 0; }
+
+static inline uint mulshift(uint m, ullong factor, int shift)
+{
+    ullong lo = ullong(m) * uint(factor), hi = ullong(m) * uint(factor >> 32);
+    return uint(((lo >> 32) + hi) >> (shift - 32));
+}
+
+// decimal digits and exponent of the shortest representation that reads back as the same float
+static void floatdigits(uint mant, uint exp, uint &digits, int &exp10)
+{
+    int e2;
+    uint m2;
+    if(!exp)
+    {
+        e2 = 1 - FLOATBIAS - FLOATMANTBITS - 2;
+        m2 = mant;
+    }
+    else
+    {
+        e2 = int(exp) - FLOATBIAS - FLOATMANTBITS - 2;
+        m2 = (1u << FLOATMANTBITS) | mant;
+    }
+    bool acceptbounds = (m2&1) == 0;
+
+    uint mv = 4*m2, mp = 4*m2 + 2, mm = 4*m2 - 1 - (mant != 0 || exp <= 1 ? 1 : 0);
+    uint vr, vp, vm;
+    int e10;
+    bool vmzeros = false, vrzeros = false;
+    uint lastremoved = 0;
+    if(e2 >= 0)
+    {
+        int q = log10pow2(e2), k = POW5INVBITS + pow5bits(q) - 1, i = -e2 + q + k;
+        e10 = q;
+        vr = mulshift(mv, pow5invsplit[q], i);
+        vp = mulshift(mp, pow5invsplit[q], i);
+        vm = mulshift(mm, pow5invsplit[q], i);
+        if(q && (vp-1)/10 <= vm/10)
+        {
+            int l = POW5INVBITS + pow5bits(q-1) - 1;
+            lastremoved = mulshift(mv, pow5invsplit[q-1], -e2 + q - 1 + l) % 10;
+        }
+        if(q <= 9)
+        {
+            if(mv%5 == 0) vrzeros = multipleofpow5(mv, q);
+            else if(acceptbounds) vmzeros = multipleofpow5(mm, q);
+            else vp -= multipleofpow5(mp, q) ? 1 : 0;
+        }
+    }
+    else
+    {
+        int q = log10pow5(-e2), i = -e2 - q, k = pow5bits(i) - POW5BITS, j = q - k;
+        e10 = q + e2;
+        vr = mulshift(mv, pow5split[i], j);
+        vp = mulshift(mp, pow5split[i], j);
+        vm = mulshift(mm, pow5split[i], j);
+        if(q && (vp-1)/10 <= vm/10)
+        {
+            j = q - 1 - (pow5bits(i+1) - POW5BITS);
+            lastremoved = mulshift(mv, pow5split[i+1], j) % 10;
+        }
+        if(q <= 1)
+        {
+            vrzeros = true;
+            if(acceptbounds) vmzeros = mm == mv - 2;
+            else vp--;
+        }
+        else if(q < 31) vrzeros = multipleofpow2(mv, q - 1);
+    }
+
+    int removed = 0;
+    if(vmzeros || vrzeros)
+    {
+        for(; vp/10 > vm/10; removed++)
+        {
+            vmzeros = vmzeros && vm%10 == 0;
+            vrzeros = vrzeros && lastremoved == 0;
+            lastremoved = vr%10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        if(vmzeros) for(; vm%10 == 0; removed++)
+        {
+            vrzeros = vrzeros && lastremoved == 0;
+            lastremoved = vr%10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        if(vrzeros && lastremoved == 5 && vr%2 == 0) lastremoved = 4;
+        digits = vr + ((vr == vm && (!acceptbounds || !vmzeros)) || lastremoved >= 5 ? 1 : 0);
+    }
+    else
+    {
+        for(; vp/10 > vm/10; removed++)
+        {
+            lastremoved = vr%10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+        }
+        digits = vr + (vr == vm || lastremoved >= 5 ? 1 : 0);
+    }
+    exp10 = e10 + removed;
+}
+
+// writes the shortest string that parses back to exactly v, returns its length
+int ftoa(char *buf, float v)
+{
+    union { float f; uint i; } conv;
+    conv.f = v;
+    uint mant = conv.i & ((1u << FLOATMANTBITS) - 1), exp = (conv.i >> FLOATMANTBITS) & ((1u << FLOATEXPBITS) - 1);
+    char *p = buf;
+    if(conv.i >> 31) *p++ = '-';
+    if(exp == (1u << FLOATEXPBITS) - 1)
+    {
+        strcpy(p, mant ? "nan" : "inf");
+        return int(p - buf) + 3;
+    }
+    if(!exp && !mant)
+    {
+        strcpy(p, "0");
+        return int(p - buf) + 1;
+    }
+
+    uint digits;
+    int exp10;
+    floatdigits(mant, exp, digits, exp10);
+    char str[10];
+    int len = 0;
+    for(; digits; digits /= 10) str[len++] = '0' + digits%10;
+    int point = len + exp10; // digits before the decimal point
+    if(point > -4 && point <= 9)
+    {
+        if(point <= 0)
+        {
+            *p++ = '0';
+            *p++ = '.';
+            for(; point < 0; point++) *p++ = '0';
+            while(len) *p++ = str[--len];
+        }
+        else
+        {
+            for(; point > 0; point--) *p++ = len ? str[--len] : '0';
+            if(len)
+            {
+                *p++ = '.';
+                while(len) *p++ = str[--len];
+            }
+        }
+    }
+    else
+    {
+        int e = point - 1;
+        *p++ = str[--len];
+        if(len)
+        {
+            *p++ = '.';
+            while(len) *p++ = str[--len];
+        }
+        *p++ = 'e';
+        if(e < 0) { *p++ = '-'; e = -e; }
+        if(e >= 10) *p++ = '0' + e/10;
+        *p++ = '0' + e%10;
+    }
+    *p = '\0';
+    return int(p - buf);
+}
@@ -5,6 +5,8 @@ static font *fontdef = NULL;
 
 font *curfont = NULL;
 
+static void cleartextlayouts();
+
 void newfont(char *name, char *tex, int *defaultw, int *defaulth, int *offsetx, int *offsety, int *offsetw, int *offseth)
 {
     font *f = fonts.access(name);
@@ -25,6 +27,7 @@ void newfont(char *name, char *tex, int *defaultw, int *defaulth, int *offsetx,
     f->offseth = *offseth;
 
     fontdef = f;
+    cleartextlayouts();
 }
 
 void fontchar(int *x, int *y, int *w, int *h)
@@ -36,6 +39,7 @@ void fontchar(int *x, int *y, int *w, int *h)
     c.y = *y;
     c.w = *w ? *w : fontdef->defaultw;
     c.h = *h ? *h : fontdef->defaulth;
+    cleartextlayouts();
 }
 
 COMMANDN(font, newfont, "ssiiiiii");
@@ -45,6 +49,7 @@ bool setfont(const char *name)
 {
     font *f = fonts.access(name);
     if(!f) return false;
+    if(f != curfont) cleartextlayouts();
     curfont = f;
     return true;
 }
@@ -99,6 +104,77 @@ void draw_textf(const char *fstr, int left, int top, ...)
     draw_text(str, left, top);
 }
 
+struct textvert
+{
+    Vec3 pos;
+    float u, v;
+    uchar color[4];
+};
+
+static Vector<textvert> textverts;
+static GLuint textverttex = 0;
+static int textbatching = 0;
+static uchar textrgba[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+static bool textxform = false;
+static Vec3 textorigin, textxaxis, textyaxis;
+
+void settextxform(const Vec3 &origin, const Vec3 &xaxis, const Vec3 &yaxis)
+{
+    textxform = true;
+    textorigin = origin;
+    textxaxis = xaxis;
+    textyaxis = yaxis;
+}
+
+void resettextxform()
+{
+    textxform = false;
+}
+
+static void flushtext()
+{
+    if(textverts.empty()) return;
+    glBindTexture(GL_TEXTURE_2D, textverttex);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(textvert), textverts[0].pos.v);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(textvert), &textverts[0].u);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(textvert), textverts[0].color);
+    glDrawArrays(GL_QUADS, 0, textverts.size());
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    textverts.setsize(0);
+}
+
+void begintextbatch()
+{
+    textbatching++;
+}
+
+void endtextbatch()
+{
+    if(textbatching > 0 && !--textbatching) flushtext();
+}
+
+static inline void addtextvert(float x, float y, float u, float v)
+{
+    textvert &t = textverts.add();
+    t.pos = textxform ? textorigin + textxaxis*x + textyaxis*y : Vec3(x, y, 0);
+    t.u = u;
+    t.v = v;
+    memcpy(t.color, textrgba, sizeof(textrgba));
+}
+
+static void settextcolor(int r, int g, int b, int a)
+{
+    textrgba[0] = r;
+    textrgba[1] = g;
+    textrgba[2] = b;
+    textrgba[3] = a;
+}
+
 static int draw_char(int c, int x, int y)
 {
     font::charinfo &info = curfont->chars[c-33];
@@ -107,10 +183,15 @@ static int draw_char(int c, int x, int y)
     float tc_right   = (info.x + info.w + curfont->offsetw) / float(curfont->scalex);
     float tc_bottom  = (info.y + info.h + curfont->offseth) / float(curfont->scaley);
 
-    glTexCoord2f(tc_left,  tc_top   ); glVertex2f(x,          y);
-    glTexCoord2f(tc_right, tc_top   ); glVertex2f(x + info.w, y);
-    glTexCoord2f(tc_right, tc_bottom); glVertex2f(x + info.w, y + info.h);
-    glTexCoord2f(tc_left,  tc_bottom); glVertex2f(x,          y + info.h);
+    if(curfont->tex != textverttex)
+    {
+        flushtext();
+        textverttex = curfont->tex;
+    }
+    addtextvert(x,          y,          tc_left,  tc_top   );
+    addtextvert(x + info.w, y,          tc_right, tc_top   );
+    addtextvert(x + info.w, y + info.h, tc_right, tc_bottom);
+    addtextvert(x,          y + info.h, tc_left,  tc_bottom);
 
     return info.w;
 }
@@ -146,7 +227,7 @@ static void text_color(char c, char *stack, int size, int &sp, textcolor color,
             case '6': color = textcolor(255, 128,   0); break;   // orange
             // white (provided color): everything else
         }
-        glColor4ub(color.x, color.y, color.z, a);
+        settextcolor(color.x, color.y, color.z, a);
     } 
 }
 
@@ -195,14 +276,97 @@ static void text_color(char c, char *stack, int size, int &sp, textcolor color,
                     else { TEXTCHAR(j) }\
                 }
 
-int text_visible(const char *str, int hitx, int hity, int maxwidth)
+struct textglyph
 {
-    #define TEXTINDEX(idx)
-    #define TEXTWHITE(idx) if(y+FONTH > hity && x >= hitx) return idx;
-    #define TEXTLINE(idx) if(y+FONTH > hity) return idx;
-    #define TEXTCOLOR(idx)
-    #define TEXTCHAR(idx) x += curfont->chars[c-33].w+1; TEXTWHITE(idx)
-    #define TEXTWORD TEXTWORDSKELETON
+    short x, y;
+    int c; // negative for color codes
+};
+
+struct textevent
+{
+    int idx, x, y;
+    bool line;
+};
+
+struct textpos
+{
+    int x, y;
+};
+
+struct textlayout
+{
+    font *f;
+    uint hash;
+    int maxwidth;
+    char *str;
+    int width, height;
+    Vector<textglyph> glyphs;
+    Vector<textevent> events;
+    Vector<textpos> positions;
+    textpos before;
+    textlayout *prev, *next, *chain;
+
+    textlayout() : f(NULL), hash(0), maxwidth(-1), str(NULL), width(0), height(0), prev(NULL), next(NULL), chain(NULL) {}
+};
+
+#define TEXTLAYOUTS 256
+
+static textlayout textlayouts[TEXTLAYOUTS];
+static textlayout *textbuckets[TEXTLAYOUTS];
+static textlayout *textlru = NULL;
+
+static void unlinktextlayout(textlayout *l)
+{
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+}
+
+static void linktextlayout(textlayout *l)
+{
+    l->next = textlru;
+    l->prev = textlru->prev;
+    l->prev->next = l;
+    l->next->prev = l;
+    textlru = l;
+}
+
+static void cleartextlayouts()
+{
+    loopi(TEXTLAYOUTS)
+    {
+        textlayout &l = textlayouts[i];
+        if(l.str) { delete[] l.str; l.str = NULL; }
+        l.chain = NULL;
+        textbuckets[i] = NULL;
+    }
+}
+
+static void addtextevent(textlayout &l, int idx, int x, int y, bool line)
+{
+    textevent &e = l.events.add();
+    e.idx = idx;
+    e.x = x;
+    e.y = y;
+    e.line = line;
+}
+
+static void layouttext(textlayout &l, const char *str, int maxwidth)
+{
+    l.glyphs.setsize(0);
+    l.events.setsize(0);
+    l.positions.setsize(0);
+    int len = strlen(str), fill = 0;
+    loopi(len+1) { textpos &p = l.positions.add(); p.x = INT_MIN; p.y = 0; }
+    l.before.x = INT_MIN;
+    l.width = 0;
+
+    // positions hold where text_pos stops for each index, events where text_visible may
+    #define TEXTINDEX(idx) if(l.positions[idx].x == INT_MIN) { l.positions[idx].x = x; l.positions[idx].y = y; }
+    #define TEXTWHITE(idx) addtextevent(l, idx, x, y, false);
+    #define TEXTLINE(idx) addtextevent(l, idx, x, y, true); if(x > l.width) l.width = x;
+    #define TEXTCOLOR(idx) { textglyph &g = l.glyphs.add(); g.x = x; g.y = y; g.c = -int(uchar(str[idx])); }
+    #define TEXTCHAR(idx) { textglyph &g = l.glyphs.add(); g.x = x; g.y = y; g.c = c; } x += curfont->chars[c-33].w + 1; TEXTWHITE(idx)
+    #define TEXTWORD TEXTWORDSKELETON for(; fill <= i; fill++) TEXTINDEX(fill) if(l.before.x == INT_MIN) { l.before.x = x; l.before.y = y; }
     TEXTSKELETON
     #undef TEXTINDEX
     #undef TEXTWHITE
@@ -210,52 +374,93 @@ int text_visible(const char *str, int hitx, int hity, int maxwidth)
     #undef TEXTCOLOR
     #undef TEXTCHAR
     #undef TEXTWORD
-    return i;
+    l.height = y + FONTH;
+    if(x > l.width) l.width = x;
+    loopv(l.positions) if(l.positions[i].x == INT_MIN) { l.positions[i].x = x; l.positions[i].y = y; }
+    if(l.before.x == INT_MIN) { l.before.x = x; l.before.y = y; }
+}
+
+// small LRU of laid out strings keyed by font, contents and wrap width
+static textlayout &gettextlayout(const char *str, int maxwidth)
+{
+    if(!textlru)
+    {
+        textlru = &textlayouts[0];
+        textlru->prev = textlru->next = textlru;
+        for(int i = TEXTLAYOUTS-1; i > 0; i--) linktextlayout(&textlayouts[i]);
+    }
+    uint h = hash(str);
+    textlayout **bucket = &textbuckets[h&(TEXTLAYOUTS-1)];
+    for(textlayout *l = *bucket; l; l = l->chain) if(l->f == curfont && l->hash == h && l->maxwidth == maxwidth && !strcmp(l->str, str))
+    {
+        if(l != textlru) { unlinktextlayout(l); linktextlayout(l); }
+        return *l;
+    }
+    textlayout *l = textlru->prev;
+    if(l->str)
+    {
+        for(textlayout **p = &textbuckets[l->hash&(TEXTLAYOUTS-1)]; *p; p = &(*p)->chain) if(*p == l) { *p = l->chain; break; }
+        delete[] l->str;
+    }
+    textlru = l;
+    l->f = curfont;
+    l->hash = h;
+    l->maxwidth = maxwidth;
+    l->str = newstring(str);
+    l->chain = *bucket;
+    *bucket = l;
+    layouttext(*l, str, maxwidth);
+    return *l;
+}
+
+int text_visible(const char *str, int hitx, int hity, int maxwidth)
+{
+    textlayout &l = gettextlayout(str, maxwidth);
+    loopv(l.events)
+    {
+        const textevent &e = l.events[i];
+        if(e.y+FONTH > hity && (e.line || e.x >= hitx)) return e.idx;
+    }
+    return l.positions.size()-1;
 }
 
 //inverse of text_visible
 void text_pos(const char *str, int cursor, int &cx, int &cy, int maxwidth) 
 {
-    #define TEXTINDEX(idx) if(idx == cursor) { cx = x; cy = y; break; }
-    #define TEXTWHITE(idx)
-    #define TEXTLINE(idx)
-    #define TEXTCOLOR(idx)
-    #define TEXTCHAR(idx) x += curfont->chars[c-33].w + 1;
-    #define TEXTWORD TEXTWORDSKELETON if(i >= cursor) break;
-    cx = INT_MIN;
-    cy = 0;
-    TEXTSKELETON
-    if(cx == INT_MIN) { cx = x; cy = y; }
-    #undef TEXTINDEX
-    #undef TEXTWHITE
-    #undef TEXTLINE
-    #undef TEXTCOLOR
-    #undef TEXTCHAR
-    #undef TEXTWORD
+    textlayout &l = gettextlayout(str, maxwidth);
+    const textpos &p = cursor < 0 ? l.before : l.positions[min(cursor, l.positions.size()-1)];
+    cx = p.x;
+    cy = p.y;
 }
 
 void text_bounds(const char *str, int &width, int &height, int maxwidth)
 {
-    #define TEXTINDEX(idx)
-    #define TEXTWHITE(idx)
-    #define TEXTLINE(idx) if(x > width) width = x;
-    #define TEXTCOLOR(idx)
-    #define TEXTCHAR(idx) x += curfont->chars[c-33].w + 1;
-    #define TEXTWORD x += w + 1;
-    width = 0;
-    TEXTSKELETON
-    height = y + FONTH;
-    TEXTLINE(_)
-    #undef TEXTINDEX
-    #undef TEXTWHITE
-    #undef TEXTLINE
-    #undef TEXTCOLOR
-    #undef TEXTCHAR
-    #undef TEXTWORD
+    textlayout &l = gettextlayout(str, maxwidth);
+    width = l.width;
+    height = l.height;
 }
 
 void draw_text(const char *str, int left, int top, int r, int g, int b, int a, int cursor, int maxwidth) 
 {
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if(cursor < 0)
+    {
+        textlayout &l = gettextlayout(str, maxwidth);
+        char colorstack[10];
+        textcolor color(r, g, b);
+        int colorpos = 0;
+        colorstack[0] = 'c'; //indicate user color
+        settextcolor(r, g, b, a);
+        loopv(l.glyphs)
+        {
+            const textglyph &g = l.glyphs[i];
+            if(g.c < 0) text_color(char(-g.c), colorstack, sizeof(colorstack), colorpos, color, a);
+            else draw_char(g.c, left+g.x, top+g.y);
+        }
+        if(!textbatching) flushtext();
+        return;
+    }
+
     #define TEXTINDEX(idx) if(idx == cursor) { cx = x; cy = y; }
     #define TEXTWHITE(idx)
     #define TEXTLINE(idx) 
@@ -266,19 +471,16 @@ void draw_text(const char *str, int left, int top, int r, int g, int b, int a, i
     textcolor color(r, g, b);
     int colorpos = 0, cx = INT_MIN, cy = 0;
     colorstack[0] = 'c'; //indicate user color
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glBindTexture(GL_TEXTURE_2D, curfont->tex);
-    glBegin(GL_QUADS);
-    glColor4ub(color.x, color.y, color.z, a);
+    settextcolor(color.x, color.y, color.z, a);
     TEXTSKELETON
     if(cursor >= 0 && (lastmillis/250)&1)
     {
-        glColor4ub(r, g, b, a);
+        settextcolor(r, g, b, a);
         if(cx == INT_MIN) { cx = x; cy = y; }
         if(maxwidth != -1 && cx >= maxwidth) { cx = 0; cy += FONTH; }
         draw_char('_', left+cx, top+cy);
     }
-    glEnd();
+    if(!textbatching) flushtext();
     #undef TEXTINDEX
     #undef TEXTWHITE
     #undef TEXTLINE
@@ -40,6 +40,17 @@ struct Vec3i
 
 struct Vec4;
 
+// reciprocal square root estimate refined with one Newton step, good to a few ulp
+static inline float fastrsqrt(float x)
+{
+#ifdef __SSE__
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y*(1.5f - 0.5f*x*y*y);
+#else
+    return 1.0f/sqrtf(x);
+#endif
+}
+
 struct Vec3
 {
     union
@@ -90,6 +101,13 @@ struct Vec3
     float squaredlen() const { return dot(*this); }
     float dist(const Vec3 &o) const { return (*this - o).magnitude(); }
     Vec3 normalize() const { return *this * (1.0f / magnitude()); }
+    Vec3 fastnormalize() const { return *this * fastrsqrt(dot(*this)); }
+    // solver inner loops normalize through this; build with -DEXACTSOLVER to keep them on exact math
+#ifdef EXACTSOLVER
+    Vec3 solvernormalize() const { return normalize(); }
+#else
+    Vec3 solvernormalize() const { return fastnormalize(); }
+#endif
     Vec3 cross(const Vec3 &o) const { return Vec3(y*o.z-z*o.y, z*o.x-x*o.z, x*o.y-y*o.x); }
     Vec3 reflect(const Vec3 &n) const { return *this - n*2.0f*dot(n); }
     Vec3 project(const Vec3 &n) const { return *this - n*dot(n); }
@@ -284,6 +302,26 @@ struct DualQuat
     }
 };
 
+#ifdef __SSE__
+// helpers for the SSE paths of the matrix types below; rows stay unaligned so the layout matches the scalar build
+static inline __m128 sseloadvec3(const Vec3 &v) { return _mm_set_ps(0, v.z, v.y, v.x); }
+static inline Vec3 ssestorevec3(__m128 v) { float r[4]; _mm_storeu_ps(r, v); return Vec3(r[0], r[1], r[2]); }
+
+#ifdef __FMA__
+static inline __m128 ssemuladd(__m128 a, __m128 b, __m128 c) { return _mm_fmadd_ps(a, b, c); }
+#else
+static inline __m128 ssemuladd(__m128 a, __m128 b, __m128 c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+#endif
+
+// (sum(a), sum(b), sum(c), 0)
+static inline __m128 ssesumrows(__m128 a, __m128 b, __m128 c)
+{
+    __m128 d = _mm_setzero_ps();
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    return _mm_add_ps(_mm_add_ps(a, b), _mm_add_ps(c, d));
+}
+#endif
+
 struct Matrix3x3
 {
     Vec3 a, b, c;
@@ -308,6 +346,13 @@ struct Matrix3x3
 
     Matrix3x3 operator*(const Matrix3x3 &o) const
     {
+#ifdef __SSE__
+        __m128 oa = sseloadvec3(o.a), ob = sseloadvec3(o.b), oc = sseloadvec3(o.c);
+        #define MULROW(row) \
+            ssestorevec3(ssemuladd(_mm_set1_ps(row.x), oa, ssemuladd(_mm_set1_ps(row.y), ob, _mm_mul_ps(_mm_set1_ps(row.z), oc))))
+        return Matrix3x3(MULROW(a), MULROW(b), MULROW(c));
+        #undef MULROW
+#else
         return Matrix3x3(
             Vec3(a.dot(Vec3(o.a.x, o.b.x, o.c.x)),
                  a.dot(Vec3(o.a.y, o.b.y, o.c.y)),
@@ -318,6 +363,7 @@ struct Matrix3x3
             Vec3(c.dot(Vec3(o.a.x, o.b.x, o.c.x)),
                  c.dot(Vec3(o.a.y, o.b.y, o.c.y)),
                  c.dot(Vec3(o.a.z, o.b.z, o.c.z))));
+#endif
     }
     Matrix3x3 &operator*=(const Matrix3x3 &o) { return (*this = *this * o); }
 
@@ -382,6 +428,19 @@ struct Matrix3x3
         }
     }
 
+#ifdef __SSE__
+    Vec3 transform(const Vec3 &o) const
+    {
+        __m128 p = sseloadvec3(o);
+        return ssestorevec3(ssesumrows(_mm_mul_ps(sseloadvec3(a), p), _mm_mul_ps(sseloadvec3(b), p), _mm_mul_ps(sseloadvec3(c), p)));
+    }
+    Vec3 transposedtransform(const Vec3 &o) const
+    {
+        return ssestorevec3(ssemuladd(sseloadvec3(a), _mm_set1_ps(o.x),
+                            ssemuladd(sseloadvec3(b), _mm_set1_ps(o.y),
+                                      _mm_mul_ps(sseloadvec3(c), _mm_set1_ps(o.z)))));
+    }
+#else
     Vec3 transform(const Vec3 &o) const { return Vec3(a.dot(o), b.dot(o), c.dot(o)); }
     Vec3 transposedtransform(const Vec3 &o) const
     {
@@ -389,6 +448,7 @@ struct Matrix3x3
                    a.y*o.x + b.y*o.y + c.y*o.z,
                    a.z*o.x + b.z*o.y + c.z*o.z);
     }
+#endif
 };
 
 struct Matrix3x4
@@ -420,6 +480,9 @@ struct Matrix3x4
         c *= invrr;
     }
 
+    bool operator==(const Matrix3x4 &o) const { return a == o.a && b == o.b && c == o.c; }
+    bool operator!=(const Matrix3x4 &o) const { return a != o.a || b != o.b || c != o.c; }
+
     Matrix3x4 &operator*=(float k)
     {
         a *= k;
@@ -457,6 +520,18 @@ struct Matrix3x4
 
     Matrix3x4 operator*(const Matrix3x4 &o) const
     {
+#ifdef __SSE__
+        __m128 oa = _mm_loadu_ps(o.a.v), ob = _mm_loadu_ps(o.b.v), oc = _mm_loadu_ps(o.c.v);
+        Matrix3x4 r;
+        #define MULROW(row) \
+            _mm_storeu_ps(r.row.v, ssemuladd(_mm_set1_ps(row.x), oa, ssemuladd(_mm_set1_ps(row.y), ob, \
+                                   ssemuladd(_mm_set1_ps(row.z), oc, _mm_set_ps(row.w, 0, 0, 0)))))
+        MULROW(a);
+        MULROW(b);
+        MULROW(c);
+        #undef MULROW
+        return r;
+#else
         return Matrix3x4(
             Vec4(a.dot3(Vec3(o.a.x, o.b.x, o.c.x)),
                  a.dot3(Vec3(o.a.y, o.b.y, o.c.y)),
@@ -470,9 +545,32 @@ struct Matrix3x4
                  c.dot3(Vec3(o.a.y, o.b.y, o.c.y)),
                  c.dot3(Vec3(o.a.z, o.b.z, o.c.z)),
                  c.dot(Vec3(o.a.w, o.b.w, o.c.w))));
+#endif
     }
     Matrix3x4 &operator*=(const Matrix3x4 &o) { return (*this = *this * o); }
 
+#ifdef __SSE__
+    Vec3 transform(const Vec3 &o) const
+    {
+        __m128 p = _mm_set_ps(1, o.z, o.y, o.x);
+        return ssestorevec3(ssesumrows(_mm_mul_ps(_mm_loadu_ps(a.v), p), _mm_mul_ps(_mm_loadu_ps(b.v), p), _mm_mul_ps(_mm_loadu_ps(c.v), p)));
+    }
+    Vec3 transposedtransform(const Vec3 &o) const
+    {
+        return transposedtransformnormal(Vec3(o.x - a.w, o.y - b.w, o.z - c.w));
+    }
+    Vec3 transformnormal(const Vec3 &o) const
+    {
+        __m128 p = sseloadvec3(o);
+        return ssestorevec3(ssesumrows(_mm_mul_ps(_mm_loadu_ps(a.v), p), _mm_mul_ps(_mm_loadu_ps(b.v), p), _mm_mul_ps(_mm_loadu_ps(c.v), p)));
+    }
+    Vec3 transposedtransformnormal(const Vec3 &o) const
+    {
+        return ssestorevec3(ssemuladd(_mm_loadu_ps(a.v), _mm_set1_ps(o.x),
+                            ssemuladd(_mm_loadu_ps(b.v), _mm_set1_ps(o.y),
+                                      _mm_mul_ps(_mm_loadu_ps(c.v), _mm_set1_ps(o.z)))));
+    }
+#else
     Vec3 transform(const Vec3 &o) const { return Vec3(a.dot(o), b.dot(o), c.dot(o)); }
     Vec3 transposedtransform(const Vec3 &o) const
     {
@@ -491,6 +589,7 @@ struct Matrix3x4
                    a.y*o.x + b.y*o.y + c.y*o.z,
                    a.z*o.x + b.z*o.y + c.z*o.z);
     }
+#endif
 };
 
 struct Plane : Vec4
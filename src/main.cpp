@@ -37,8 +37,93 @@ void resizescreen(int w, int h)
     screen = resized;
 }
 
+PFNGLGENBUFFERSARBPROC    glGenBuffers_    = NULL;
+PFNGLBINDBUFFERARBPROC    glBindBuffer_    = NULL;
+PFNGLBUFFERDATAARBPROC    glBufferData_    = NULL;
+PFNGLBUFFERSUBDATAARBPROC glBufferSubData_ = NULL;
+PFNGLDELETEBUFFERSARBPROC glDeleteBuffers_ = NULL;
+
+#ifndef GL_ARB_instanced_arrays
+#define GL_ARB_instanced_arrays 1
+typedef void (APIENTRYP PFNGLVERTEXATTRIBDIVISORARBPROC) (GLuint index, GLuint divisor);
+#endif
+#ifndef GL_ARB_draw_instanced
+#define GL_ARB_draw_instanced 1
+typedef void (APIENTRYP PFNGLDRAWELEMENTSINSTANCEDARBPROC) (GLenum mode, GLsizei count, GLenum type, const GLvoid *indices, GLsizei primcount);
+#endif
+
+PFNGLCREATESHADERPROC              glCreateShader_              = NULL;
+PFNGLDELETESHADERPROC              glDeleteShader_              = NULL;
+PFNGLSHADERSOURCEPROC              glShaderSource_              = NULL;
+PFNGLCOMPILESHADERPROC             glCompileShader_             = NULL;
+PFNGLGETSHADERIVPROC               glGetShaderiv_               = NULL;
+PFNGLCREATEPROGRAMPROC             glCreateProgram_             = NULL;
+PFNGLDELETEPROGRAMPROC             glDeleteProgram_             = NULL;
+PFNGLATTACHSHADERPROC              glAttachShader_              = NULL;
+PFNGLLINKPROGRAMPROC               glLinkProgram_               = NULL;
+PFNGLGETPROGRAMIVPROC              glGetProgramiv_              = NULL;
+PFNGLUSEPROGRAMPROC                glUseProgram_                = NULL;
+PFNGLGETATTRIBLOCATIONPROC         glGetAttribLocation_         = NULL;
+PFNGLVERTEXATTRIBPOINTERPROC       glVertexAttribPointer_       = NULL;
+PFNGLENABLEVERTEXATTRIBARRAYPROC   glEnableVertexAttribArray_   = NULL;
+PFNGLDISABLEVERTEXATTRIBARRAYPROC  glDisableVertexAttribArray_  = NULL;
+PFNGLVERTEXATTRIBDIVISORARBPROC    glVertexAttribDivisor_       = NULL;
+PFNGLDRAWELEMENTSINSTANCEDARBPROC  glDrawElementsInstanced_     = NULL;
+
+bool hasVBO = false, hasinstancing = false;
+
+VAR(usevbo, 0, 1, 1);
+
+void gl_checkextensions()
+{
+    const char *exts = (const char *)glGetString(GL_EXTENSIONS), *version = (const char *)glGetString(GL_VERSION);
+    if(!exts) return;
+    if(strstr(exts, "GL_ARB_vertex_buffer_object"))
+    {
+        glGenBuffers_    = (PFNGLGENBUFFERSARBPROC)   SDL_GL_GetProcAddress("glGenBuffersARB");
+        glBindBuffer_    = (PFNGLBINDBUFFERARBPROC)   SDL_GL_GetProcAddress("glBindBufferARB");
+        glBufferData_    = (PFNGLBUFFERDATAARBPROC)   SDL_GL_GetProcAddress("glBufferDataARB");
+        glBufferSubData_ = (PFNGLBUFFERSUBDATAARBPROC)SDL_GL_GetProcAddress("glBufferSubDataARB");
+        glDeleteBuffers_ = (PFNGLDELETEBUFFERSARBPROC)SDL_GL_GetProcAddress("glDeleteBuffersARB");
+        hasVBO = glGenBuffers_ && glBindBuffer_ && glBufferData_ && glBufferSubData_ && glDeleteBuffers_;
+    }
+    if(hasVBO && version && atoi(version) >= 2 && strstr(exts, "GL_ARB_instanced_arrays") && strstr(exts, "GL_ARB_draw_instanced"))
+    {
+        glCreateShader_             = (PFNGLCREATESHADERPROC)            SDL_GL_GetProcAddress("glCreateShader");
+        glDeleteShader_             = (PFNGLDELETESHADERPROC)            SDL_GL_GetProcAddress("glDeleteShader");
+        glShaderSource_             = (PFNGLSHADERSOURCEPROC)            SDL_GL_GetProcAddress("glShaderSource");
+        glCompileShader_            = (PFNGLCOMPILESHADERPROC)           SDL_GL_GetProcAddress("glCompileShader");
+        glGetShaderiv_              = (PFNGLGETSHADERIVPROC)             SDL_GL_GetProcAddress("glGetShaderiv");
+        glCreateProgram_            = (PFNGLCREATEPROGRAMPROC)           SDL_GL_GetProcAddress("glCreateProgram");
+        glDeleteProgram_            = (PFNGLDELETEPROGRAMPROC)           SDL_GL_GetProcAddress("glDeleteProgram");
+        glAttachShader_             = (PFNGLATTACHSHADERPROC)            SDL_GL_GetProcAddress("glAttachShader");
+        glLinkProgram_              = (PFNGLLINKPROGRAMPROC)             SDL_GL_GetProcAddress("glLinkProgram");
+        glGetProgramiv_             = (PFNGLGETPROGRAMIVPROC)            SDL_GL_GetProcAddress("glGetProgramiv");
+        glUseProgram_               = (PFNGLUSEPROGRAMPROC)              SDL_GL_GetProcAddress("glUseProgram");
+        glGetAttribLocation_        = (PFNGLGETATTRIBLOCATIONPROC)       SDL_GL_GetProcAddress("glGetAttribLocation");
+        glVertexAttribPointer_      = (PFNGLVERTEXATTRIBPOINTERPROC)     SDL_GL_GetProcAddress("glVertexAttribPointer");
+        glEnableVertexAttribArray_  = (PFNGLENABLEVERTEXATTRIBARRAYPROC) SDL_GL_GetProcAddress("glEnableVertexAttribArray");
+        glDisableVertexAttribArray_ = (PFNGLDISABLEVERTEXATTRIBARRAYPROC)SDL_GL_GetProcAddress("glDisableVertexAttribArray");
+        glVertexAttribDivisor_      = (PFNGLVERTEXATTRIBDIVISORARBPROC)  SDL_GL_GetProcAddress("glVertexAttribDivisorARB");
+        glDrawElementsInstanced_    = (PFNGLDRAWELEMENTSINSTANCEDARBPROC)SDL_GL_GetProcAddress("glDrawElementsInstancedARB");
+        hasinstancing = glCreateShader_ && glDeleteShader_ && glShaderSource_ && glCompileShader_ && glGetShaderiv_ &&
+                        glCreateProgram_ && glDeleteProgram_ && glAttachShader_ && glLinkProgram_ && glGetProgramiv_ && glUseProgram_ &&
+                        glGetAttribLocation_ && glVertexAttribPointer_ && glEnableVertexAttribArray_ && glDisableVertexAttribArray_ &&
+                        glVertexAttribDivisor_ && glDrawElementsInstanced_;
+    }
+}
+
+void stopautosave();
+
+void cancelmodelload();
+
+void stopskinworkers();
+
 void quit()
 {
+    cancelmodelload();
+    stopautosave();
+    stopskinworkers();
     SDL_ShowCursor(1);
     SDL_Quit();
 
@@ -134,14 +219,23 @@ struct MTri
 
 struct MVert
 {
-    Vec3 pos, curpos;
+    Vec3 pos;
     int joints[4];
     float weights[4];
+    bool dirty;
 };
 
 String mname = "";
 Vector<MTri> mtris;
 Vector<MVert> mverts;
+Vector<Vec3> mcurverts;
+Vector<int> jointvertoffsets, jointverts, dirtyverts;
+int mdirtymin = INT_MAX, mdirtymax = -1;
+GLuint mvbo = 0, mibo = 0;
+Vector<float> skinpos[3], skinweights[4];
+Vector<int> skinjoints[4];
+Vector<Matrix3x4> skinmats;
+Vector<DualQuat> skindqs;
 float mscale = 1, moffset = 0;
 
 extern int cursormode, animmode;
@@ -177,15 +271,13 @@ FVAR(spherescale, 0, 0.2f, 10);
 
 struct Sphere
 {
-    Vec3 oldpos, pos, newpos, saved[3], dragoffset;
+    Vec3 oldpos, pos, newpos, dragoffset;
     float size;
     int avg;
     bool sticky, collided, eye;
 
-    Sphere(const Vec3 &pos, float size) : oldpos(pos), pos(pos), dragoffset(0, 0, 0), size(size), sticky(false), collided(false), eye(false)
-    {
-        loopk(3) saved[k] = pos;
-    }
+    Sphere() {}
+    Sphere(const Vec3 &pos, float size) : oldpos(pos), pos(pos), dragoffset(0, 0, 0), size(size), sticky(false), collided(false), eye(false) {}
 
     bool intersect(const Vec3 &o, const Vec3 &ray, float &dist) const
     {
@@ -195,20 +287,51 @@ struct Sphere
 
 Vector<Sphere> spheres;
 
+enum { CONSTRAINT_DIST = 0, CONSTRAINT_ROT };
+
 struct Constraint
 {
+    virtual int type() = 0;
     virtual void apply() = 0;
     virtual void render() = 0;
     virtual void save(FILE *f) = 0;
     virtual bool load(const char *buf) = 0;
     virtual bool uses(int type, int idx) = 0;
     virtual void remap(int type, int idx) = 0;
+    virtual void unremap(int type, int idx) = 0;
     virtual void update() {}
     virtual void writecfg(FILE *f) = 0;
     virtual void printconsole() = 0;
+    virtual Constraint *copy() = 0;
     virtual ~Constraint() {}
 };
 
+// solver counters for the most recent animation step, readable from scripts
+struct SolverStats
+{
+    int passes, applied, activerots, contacts, corrections;
+    float maxcorrection, totalcorrection;
+    ullong passtime;
+
+    SolverStats() { reset(); }
+
+    void reset()
+    {
+        passes = applied = activerots = contacts = corrections = 0;
+        maxcorrection = totalcorrection = 0;
+        passtime = 0;
+    }
+
+    void addcorrection(float dist)
+    {
+        corrections++;
+        totalcorrection += dist;
+        maxcorrection = max(maxcorrection, dist);
+    }
+};
+
+SolverStats solverstats;
+
 VAR(linweight, 1, 1, 10);
 
 struct DistConstraint : Constraint
@@ -234,6 +357,10 @@ struct DistConstraint : Constraint
         dist = (spheres[sphere2].pos - spheres[sphere1].pos).magnitude();
     }
 
+    int type() { return CONSTRAINT_DIST; }
+
+    Constraint *copy() { return new DistConstraint(*this); }
+
     bool uses(int type, int idx) { return type==SEL_SPHERE && (idx==sphere1 || idx==sphere2); }
 
     void remap(int type, int idx)
@@ -245,10 +372,20 @@ struct DistConstraint : Constraint
         }
     }
 
+    void unremap(int type, int idx)
+    {
+        if(type==SEL_SPHERE)
+        {
+            if(sphere1 >= idx) sphere1++;
+            if(sphere2 >= idx) sphere2++;
+        }
+    }
+
     void apply()
     {
+        solverstats.applied++;
         Sphere &s1 = spheres[sphere1], &s2 = spheres[sphere2];
-        Vec3 dir = (s2.pos - s1.pos).normalize(),
+        Vec3 dir = (s2.pos - s1.pos).solvernormalize(),
              center = (s1.pos + s2.pos) * 0.5f;
         s1.newpos += (center - dir*(dist*0.5f))*linweight;
         s1.avg += linweight;
@@ -268,12 +405,12 @@ struct DistConstraint : Constraint
 
     void save(FILE *f)
     {
-        fprintf(f, "d %d %d %f\n", sphere1, sphere2, dist);
+        fprintf(f, "d %d %d %s\n", sphere1, sphere2, floatstr(dist));
     }
 
     void writecfg(FILE *f)
     {
-        fprintf(f, "rdlimitdist %d %d %f\n", sphere1, sphere2, dist / mscale);
+        fprintf(f, "rdlimitdist %d %d %s\n", sphere1, sphere2, floatstr(dist / mscale));
     }
 
     bool load(const char *buf)
@@ -290,14 +427,18 @@ struct DistConstraint : Constraint
 
 Vector<Constraint *> constraints;
 
+uint triversion = 0;
+
 struct Tri
 {
     int sphere1, sphere2, sphere3;
 
     Matrix3x3 orient;
+    uint version; // changes whenever orient does
 
-    Tri(int s1, int s2, int s3) : sphere1(s1), sphere2(s2), sphere3(s3)
+    Tri(int s1, int s2, int s3) : sphere1(s1), sphere2(s2), sphere3(s3), version(++triversion)
     {
+        orient.a = orient.b = orient.c = Vec3(0, 0, 0);
         calcorient();
     }
 
@@ -316,12 +457,28 @@ struct Tri
         }
     }
 
+    // inverse of remap, for putting a removed element back
+    void unremap(int type, int idx)
+    {
+        if(type==SEL_SPHERE)
+        {
+            if(sphere1 >= idx) sphere1++;
+            if(sphere2 >= idx) sphere2++;
+            if(sphere3 >= idx) sphere3++;
+        }
+    }
+
     void calcorient()
     {
         Sphere &s1 = spheres[sphere1], &s2 = spheres[sphere2], &s3 = spheres[sphere3];
-        orient.a = (s2.pos - s1.pos).normalize();
-        orient.c = orient.a.cross(s3.pos - s1.pos).normalize();
-        orient.b = orient.c.cross(orient.a);
+        Vec3 a = (s2.pos - s1.pos).solvernormalize(),
+             c = a.cross(s3.pos - s1.pos).solvernormalize(),
+             b = c.cross(a);
+        if(a == orient.a && b == orient.b && c == orient.c) return;
+        orient.a = a;
+        orient.b = b;
+        orient.c = c;
+        version = ++triversion;
     }
 
     void render()
@@ -375,6 +532,10 @@ struct RotConstraint : Constraint
         middle *= inv;
     }
 
+    int type() { return CONSTRAINT_ROT; }
+
+    Constraint *copy() { return new RotConstraint(*this); }
+
     bool uses(int type, int idx)
     {
         if(type==SEL_TRI && (idx==tri1 || idx==tri2)) return true;
@@ -390,10 +551,31 @@ struct RotConstraint : Constraint
         }
     }
 
+    void unremap(int type, int idx)
+    {
+        if(type==SEL_TRI)
+        {
+            if(tri1 >= idx) tri1++;
+            if(tri2 >= idx) tri2++;
+        }
+    }
+
+    typedef void (RotConstraint::*applyfunc)();
+    static const applyfunc applyfuncs[7][3];
+    static applyfunc applymode;
+
+    // picks the kernel for the current angmom/rotcenter, once per solver pass
+    static void selectmode() { applymode = applyfuncs[angmom][rotcenter]; }
+
     void apply()
     {
         if(!applyrots) return;
+        solverstats.applied++;
+        (this->*applymode)();
+    }
 
+    template<int ANGMOM, int ROTCENTER> void applymodes()
+    {
         Tri &t1 = tris[tri1], &t2 = tris[tri2];
         Matrix3x3 rot;
         rot.transpose(t1.orient);
@@ -411,54 +593,66 @@ struct RotConstraint : Constraint
         else if(angle <= maxangle) return;
         else angle = maxangle - angle;
         angle += 1e-3f;
+        solverstats.activerots++;
 
         Vec3 c1 = (spheres[t1.sphere1].pos + spheres[t1.sphere2].pos + spheres[t1.sphere3].pos)/3,
-             c2 = (spheres[t2.sphere1].pos + spheres[t2.sphere2].pos + spheres[t2.sphere3].pos)/3,
-             cmass = (c1 + c2)/2, diff1(0, 0, 0), diff2(0, 0, 0);
-        if(rotcenter>=2) c1 = c2 = cmass;
-        Matrix3x3 wrot, crot1, crot2;
-        wrot.rotate(radians(0.5f), axis);
-        float w1 = wrot.transform(spheres[t1.sphere1].pos - c1).dist(spheres[t1.sphere1].pos - c1) +
-                   wrot.transform(spheres[t1.sphere2].pos - c1).dist(spheres[t1.sphere2].pos - c1) +
-                   wrot.transform(spheres[t1.sphere3].pos - c1).dist(spheres[t1.sphere3].pos - c1),
-              w2 = wrot.transform(spheres[t2.sphere1].pos - c2).dist(spheres[t2.sphere1].pos - c2) +
-                   wrot.transform(spheres[t2.sphere2].pos - c2).dist(spheres[t2.sphere2].pos - c2) +
-                   wrot.transform(spheres[t2.sphere3].pos - c2).dist(spheres[t2.sphere3].pos - c2),
-              a1 = (spheres[t1.sphere2].pos - spheres[t1.sphere1].pos).cross(spheres[t1.sphere3].pos - spheres[t1.sphere1].pos).magnitude(),
-              a2 = (spheres[t1.sphere2].pos - spheres[t1.sphere1].pos).cross(spheres[t1.sphere3].pos - spheres[t1.sphere1].pos).magnitude();
-
-        switch(angmom)
-        {
-        case 0:
+             c2 = (spheres[t2.sphere1].pos + spheres[t2.sphere2].pos + spheres[t2.sphere3].pos)/3;
+        if(ROTCENTER>=2) c1 = c2 = (c1 + c2)/2;
+        Matrix3x3 crot1, crot2;
+        if(ANGMOM==0)
+        {
             crot1.rotate(angle*rotfric*0.5f, axis);
             crot2.rotate(angle*rotfric*0.5f, axis);
-            break;
-        case 1:
-            crot1.rotate(angle*rotfric*w1/(w1+w2), axis);
-            crot2.rotate(angle*rotfric*w2/(w1+w2), axis);
-            break;
-        case 2:
-            crot1.rotate(angle*rotfric*w2/(w1+w2), axis);
-            crot2.rotate(angle*rotfric*w1/(w1+w2), axis);
-            break;
-        case 3:
-            crot1.rotate(angle*rotfric*w2/w1, axis);
-            crot2.rotate(angle*rotfric*w1/w2, axis);
-            break;
-        case 4:
-            crot1.rotate(angle*rotfric*a1/(a1+a2), axis);
-            crot2.rotate(angle*rotfric*a2/(a1+a2), axis);
-            break;
-        case 5:
-            crot1.rotate(angle*rotfric*a2/(a1+a2), axis);
-            crot2.rotate(angle*rotfric*a1/(a1+a2), axis);
-            break;
-        case 6:
-            crot1.rotate(angle*rotfric*a2/a1, axis);
-            crot2.rotate(angle*rotfric*a1/a2, axis);
-            break;
+        }
+        else if(ANGMOM<=3)
+        {
+            Matrix3x3 wrot;
+            wrot.rotate(radians(0.5f), axis);
+            float w1 = wrot.transform(spheres[t1.sphere1].pos - c1).dist(spheres[t1.sphere1].pos - c1) +
+                       wrot.transform(spheres[t1.sphere2].pos - c1).dist(spheres[t1.sphere2].pos - c1) +
+                       wrot.transform(spheres[t1.sphere3].pos - c1).dist(spheres[t1.sphere3].pos - c1),
+                  w2 = wrot.transform(spheres[t2.sphere1].pos - c2).dist(spheres[t2.sphere1].pos - c2) +
+                       wrot.transform(spheres[t2.sphere2].pos - c2).dist(spheres[t2.sphere2].pos - c2) +
+                       wrot.transform(spheres[t2.sphere3].pos - c2).dist(spheres[t2.sphere3].pos - c2);
+            if(ANGMOM==1)
+            {
+                crot1.rotate(angle*rotfric*w1/(w1+w2), axis);
+                crot2.rotate(angle*rotfric*w2/(w1+w2), axis);
+            }
+            else if(ANGMOM==2)
+            {
+                crot1.rotate(angle*rotfric*w2/(w1+w2), axis);
+                crot2.rotate(angle*rotfric*w1/(w1+w2), axis);
+            }
+            else
+            {
+                crot1.rotate(angle*rotfric*w2/w1, axis);
+                crot2.rotate(angle*rotfric*w1/w2, axis);
+            }
+        }
+        else
+        {
+            // both area weights come from t1, as they always have
+            float a1 = (spheres[t1.sphere2].pos - spheres[t1.sphere1].pos).cross(spheres[t1.sphere3].pos - spheres[t1.sphere1].pos).magnitude(),
+                  a2 = a1;
+            if(ANGMOM==4)
+            {
+                crot1.rotate(angle*rotfric*a1/(a1+a2), axis);
+                crot2.rotate(angle*rotfric*a2/(a1+a2), axis);
+            }
+            else if(ANGMOM==5)
+            {
+                crot1.rotate(angle*rotfric*a2/(a1+a2), axis);
+                crot2.rotate(angle*rotfric*a1/(a1+a2), axis);
+            }
+            else
+            {
+                crot1.rotate(angle*rotfric*a2/a1, axis);
+                crot2.rotate(angle*rotfric*a1/a2, axis);
+            }
         }
 
+        Vec3 diff1(0, 0, 0), diff2(0, 0, 0);
         #define ROTSPHERE(sphere, crot, trans, cmass, diff) \
         { \
             Sphere &s = spheres[sphere]; \
@@ -473,10 +667,11 @@ struct RotConstraint : Constraint
         ROTSPHERE(t2.sphere1, crot2, transposedtransform, c2, diff2);
         ROTSPHERE(t2.sphere2, crot2, transposedtransform, c2, diff2);
         ROTSPHERE(t2.sphere3, crot2, transposedtransform, c2, diff2);
+        #undef ROTSPHERE
 
         diff1 /= 3;
         diff2 /= 3;
-        if(rotcenter) { diff1 += diff2; diff1 /= 2; diff2 = diff1; }
+        if(ROTCENTER) { diff1 += diff2; diff1 /= 2; diff2 = diff1; }
 
         diff1 *= rotweight;
         diff2 *= rotweight;
@@ -632,11 +827,11 @@ struct RotConstraint : Constraint
 
     void save(FILE *f)
     {
-        fprintf(f, "r %d %d %f %f %f %f %f %f %f %f %f %f\n",
-            tri1, tri2, maxangle,
-            middle.a.x, middle.a.y, middle.a.z,
-            middle.b.x, middle.b.y, middle.b.z,
-            middle.c.x, middle.c.y, middle.c.z);
+        fprintf(f, "r %d %d %s %s %s %s %s %s %s %s %s %s\n",
+            tri1, tri2, floatstr(maxangle),
+            floatstr(middle.a.x), floatstr(middle.a.y), floatstr(middle.a.z),
+            floatstr(middle.b.x), floatstr(middle.b.y), floatstr(middle.b.z),
+            floatstr(middle.c.x), floatstr(middle.c.y), floatstr(middle.c.z));
     }
 
     bool load(const char *buf)
@@ -657,23 +852,35 @@ struct RotConstraint : Constraint
     void writecfg(FILE *f)
     {
         Quat q(middle);
-        fprintf(f, "rdlimitrot %d %d %f %f %f %f %f\n", tri1, tri2, degrees(maxangle), q.x, q.y, q.z, q.w);
+        fprintf(f, "rdlimitrot %d %d %s %s %s %s %s\n", tri1, tri2, floatstr(degrees(maxangle)), floatstr(q.x), floatstr(q.y), floatstr(q.z), floatstr(q.w));
     }
 
 };
 
+#define ROTMODES(angmom) { &RotConstraint::applymodes<angmom, 0>, &RotConstraint::applymodes<angmom, 1>, &RotConstraint::applymodes<angmom, 2> }
+const RotConstraint::applyfunc RotConstraint::applyfuncs[7][3] =
+{
+    ROTMODES(0), ROTMODES(1), ROTMODES(2), ROTMODES(3), ROTMODES(4), ROTMODES(5), ROTMODES(6)
+};
+#undef ROTMODES
+RotConstraint::applyfunc RotConstraint::applymode = &RotConstraint::applymodes<2, 0>;
+
+bool jointmapdirty = true;
+
 struct Joint
 {
     char name[256];
     int index, parent;
     Vec3 pos;
-    bool used, haschild, moved;
+    bool used, haschild, moved, dirty;
     int hide, tri, spheres[3];
     Matrix3x4 tridiff, orient;
+    uint poseversion; // version of tri that orient was last derived from, 0 if stale
+    Vec3 posecenter;
 
     Joint(const char *desc, int index, int parent, const Vec3 &pos)
-      : index(index), parent(parent), pos(pos), used(false), haschild(false), hide(desc[0]=='!' ? 1 : 0),
-        tri(-1)
+      : index(index), parent(parent), pos(pos), used(false), haschild(false), dirty(true), hide(desc[0]=='!' ? 1 : 0),
+        tri(-1), poseversion(0)
     {
         strcpy(name, desc);
         loopk(3) spheres[k] = -1;
@@ -701,10 +908,19 @@ struct Joint
 
     void killbind()
     {
+        jointmapdirty = true;
         tri = -1;
         loopk(3) spheres[k] = -1;
         orient.identity();
         tridiff.identity();
+        dirty = true;
+    }
+
+    void setorient(const Matrix3x4 &m)
+    {
+        if(orient == m) return;
+        orient = m;
+        dirty = true;
     }
 
     Vec3 getpos() const { return orient.transform(pos); }
@@ -717,15 +933,16 @@ struct Joint
     void save(FILE *f)
     {
         if(tri<0) return;
-        fprintf(f, "j %d %d %d %d %d %f %f %f %f %f %f %f %f %f %f %f %f\n",
+        fprintf(f, "j %d %d %d %d %d %s %s %s %s %s %s %s %s %s %s %s %s\n",
             index, tri, spheres[0], spheres[1], spheres[2],
-            tridiff.a.x, tridiff.a.y, tridiff.a.z, tridiff.a.w,
-            tridiff.b.x, tridiff.b.y, tridiff.b.z, tridiff.b.w,
-            tridiff.c.x, tridiff.c.y, tridiff.c.z, tridiff.c.w);
+            floatstr(tridiff.a.x), floatstr(tridiff.a.y), floatstr(tridiff.a.z), floatstr(tridiff.a.w),
+            floatstr(tridiff.b.x), floatstr(tridiff.b.y), floatstr(tridiff.b.z), floatstr(tridiff.b.w),
+            floatstr(tridiff.c.x), floatstr(tridiff.c.y), floatstr(tridiff.c.z), floatstr(tridiff.c.w));
     }
 
     bool load(const char *buf)
     {
+        jointmapdirty = true;
         int num = sscanf(buf+1, " %*d %d %d %d %d %f %f %f %f %f %f %f %f %f %f %f %f",
             &tri, &spheres[0], &spheres[1], &spheres[2],
             &tridiff.a.x, &tridiff.a.y, &tridiff.a.z, &tridiff.a.w,
@@ -739,223 +956,1080 @@ struct Joint
 };
 Vector<Joint> joints;
 
-VAR(showspheres, 0, 1, 1);
-VAR(showjoints, 0, 1, 2);
-VAR(showtris, 0, 1, 1);
-VAR(showconstraints, 0, 1, 1);
+// parent-before-child order of the joints, and for joints not driven by a tri the nearest ancestor that is
+Vector<int> jointorder, jointanc, boundjoints, unboundjoints;
 
-void hover()
+void calcjointorder()
 {
-    hovertype = -1;
-    hoveridx = -1;
-    hoverdist = 0;
-    if(dragging >= 0) return;
-
-    float dist;
-    if(showspheres) loopv(spheres)
-    {
-        const Sphere &s = spheres[i];
-        if(s.intersect(campos, camdir, dist) && (hovertype < 0 || dist < hoverdist)) { hovertype = SEL_SPHERE; hoveridx = i; hoverdist = dist; }
-    }
-    if(showjoints) loopv(joints)
+    Vector<int> depth, chain;
+    loopv(joints) depth.add(-1);
+    int maxdepth = 0;
+    loopv(joints)
     {
-        const Joint &j = joints[i];
-        if(!j.hide && j.intersect(campos, camdir, 0.1f, dist) && (hovertype < 0 || dist < hoverdist)) { hovertype = SEL_JOINT; hoveridx = i; hoverdist = dist; }
+        int cur = i;
+        while(joints.inrange(cur) && depth[cur] < 0 && chain.size() <= joints.size()) { chain.add(cur); cur = joints[cur].parent; }
+        int d = joints.inrange(cur) && depth[cur] >= 0 ? depth[cur] : -1;
+        while(chain.size()) depth[chain.pop()] = ++d;
+        maxdepth = max(maxdepth, d);
     }
-    if(showtris) loopv(tris)
+    Vector<int> start;
+    loopi(maxdepth+2) start.add(0);
+    loopv(joints) start[depth[i]+1]++;
+    loopi(maxdepth+1) start[i+1] += start[i];
+    jointorder.setsize(0);
+    loopv(joints) jointorder.add(0);
+    loopv(joints) jointorder[start[depth[i]]++] = i;
+}
+
+bool jointbound(const Joint &j)
+{
+    if(!tris.inrange(j.tri)) return false;
+    loopk(3) if(spheres.inrange(j.spheres[k])) return true;
+    return false;
+}
+
+void updatejointmap()
+{
+    if(jointorder.size() != joints.size()) calcjointorder();
+    jointanc.setsize(0);
+    loopv(joints) jointanc.add(-1);
+    boundjoints.setsize(0);
+    unboundjoints.setsize(0);
+    loopv(joints) joints[i].poseversion = 0;
+    loopv(jointorder)
     {
-        const Tri &t = tris[i];
-        if(t.intersect(campos, camdir, dist) && (hovertype < 0 || dist < hoverdist)) { hovertype = SEL_TRI; hoveridx = i; hoverdist = dist; }
+        int idx = jointorder[i];
+        const Joint &j = joints[idx];
+        if(jointbound(j)) { boundjoints.add(idx); continue; }
+        unboundjoints.add(idx);
+        if(joints.inrange(j.parent)) jointanc[idx] = jointbound(joints[j.parent]) ? j.parent : jointanc[j.parent];
     }
-    hoverdist /= camscale;
+    jointmapdirty = false;
 }
 
-ICOMMAND(gethoverdist, "", (), floatret(hoverdist));
+VAR(showspheres, 0, 1, 1);
+VAR(showjoints, 0, 1, 2);
+VAR(showtris, 0, 1, 1);
+VAR(showconstraints, 0, 1, 1);
 
-VAR(dbgselect, 0, 0, 1);
+// autosave journal: editing commands append scene-style records that are replayed over the last snapshot
+FILE *journal = NULL;
+bool replaying = false, journaldirty = false, snapshotrequested = false;
+int journalrecords = 0;
 
-void select()
+FILE *journalfile()
 {
-    if(hovertype>=0 && (selected[hovertype].empty() || selected[hovertype].last()!=hoveridx))
-    {
-        static const char *names[MAXSEL] = { "sphere", "tri", "joint" };
-        if(dbgselect) conoutf("select: %s %d", names[hovertype], hoveridx);
-        selected[hovertype].add(hoveridx);
-        if(dragging>=0 && hovertype==SEL_SPHERE) spheres[hoveridx].dragoffset = spheres[hoveridx].pos - spheres[dragging].pos;
-    }
+    return journal && !replaying ? journal : NULL;
 }
-COMMAND(select, "");
 
-void selectall(int *type)
+void journalf(const char *fmt, ...)
 {
-    switch(*type)
-    {
-        case 0: selected[SEL_SPHERE].setsize(0); loopv(spheres) selected[SEL_SPHERE].add(i); break;
-        case 1: selected[SEL_TRI].setsize(0); loopv(tris) selected[SEL_TRI].add(i); break;
-        case 2: selected[SEL_JOINT].setsize(0); loopv(joints) selected[SEL_JOINT].add(i); break;
-    }
+    FILE *f = journalfile();
+    if(!f) return;
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(f, fmt, args);
+    va_end(args);
+    journalrecords++;
 }
-COMMAND(selectall, "i");
 
-void cancelselect()
+void journalpos(int idx)
 {
-    loopk(MAXSEL) selected[k].setsize(0);
+    const Vec3 &pos = spheres[idx].pos;
+    journalf("p %d %s %s %s\n", idx, floatstr(pos.x), floatstr(pos.y), floatstr(pos.z));
 }
-COMMAND(cancelselect, "");
 
-void drag(int *isdown)
+void journalsphere(int idx)
 {
-    if(!*isdown) { dragging = -1; return; }
-    if(hovertype==SEL_SPHERE)
-    {
-        dragging = hoveridx;
-        dragdist = camera.origin.dist(spheres[hoveridx].pos)/camscale;
-        spheres[dragging].dragoffset = Vec3(0, 0, 0);
+    const Sphere &s = spheres[idx];
+    journalf("s %s %s %s %s %d\n", floatstr(s.pos.x), floatstr(s.pos.y), floatstr(s.pos.z), floatstr(max(s.size, 1.0f)), s.sticky ? 1 : 0);
+}
 
-        loopv(selected[SEL_SPHERE])
-        {
-            Sphere &s = spheres[selected[SEL_SPHERE][i]];
-            s.dragoffset = s.pos - spheres[dragging].pos;
-        }
-    }
+void journalconstraint(Constraint *c)
+{
+    FILE *f = journalfile();
+    if(!f) return;
+    c->save(f);
+    journalrecords++;
 }
-COMMAND(drag, "D");
 
-int delcmp(const int *x, const int *y)
+void journaljoint(int idx)
 {
-    if(*x > *y) return -1;
-    if(*x < *y) return 1;
-    return 0;
+    FILE *f = journalfile();
+    if(!f) return;
+    joints[idx].save(f);
+    journalrecords++;
 }
 
-void delselect()
+// for bulk edits where a fresh snapshot is cheaper than per-element records
+void requestsnapshot()
 {
-    Vector<int> ds, dt, dj, dc;
-    loopv(selected[SEL_SPHERE]) ds.add(selected[SEL_SPHERE][i]);
-    loopv(selected[SEL_TRI]) dt.add(selected[SEL_TRI][i]);
-    loopv(selected[SEL_JOINT]) dj.add(selected[SEL_JOINT][i]);
-    loopv(ds)
-    {
-        if(dragging==ds[i]) dragging = -1;
-        loopvj(tris) if(tris[j].uses(SEL_SPHERE, ds[i]) && dt.find(j)<0) dt.add(j);
-        loopvj(joints) if(joints[j].uses(SEL_SPHERE, ds[i]) && dj.find(j)<0) dj.add(j);
-        loopvj(constraints) if(constraints[j]->uses(SEL_SPHERE, ds[i]) && dc.find(j)<0) dc.add(j);
-    }
-    loopv(dt)
-    {
-        loopvj(joints) if(joints[j].uses(SEL_TRI, dt[i]) && dj.find(j)<0) dj.add(j);
-        loopvj(constraints) if(constraints[j]->uses(SEL_TRI, dt[i]) && dc.find(j)<0) dc.add(j);
-    }
-    dc.sort(delcmp);
-    dj.sort(delcmp);
-    dt.sort(delcmp);
-    ds.sort(delcmp);
-    loopv(ds)
-    {
-        loopvj(tris) tris[j].remap(SEL_SPHERE, ds[i]);
-        loopvj(joints) joints[j].remap(SEL_SPHERE, ds[i]);
-        loopvj(constraints) constraints[j]->remap(SEL_SPHERE, ds[i]);
-    }
-    loopv(dt)
-    {
-        loopvj(joints) joints[j].remap(SEL_TRI, dt[i]);
-        loopvj(constraints) constraints[j]->remap(SEL_TRI, dt[i]);
-    }
-    loopv(dc) delete constraints.remove(dc[i]);
-    loopv(dj) joints[dj[i]].killbind();
-    loopv(dt) tris.remove(dt[i]);
-    loopv(ds) spheres.remove(ds[i]);
-    loopk(3) selected[k].setsize(0);
+    if(journalfile()) snapshotrequested = true;
 }
-COMMAND(delselect, "");
 
-void stopspheres()
+// position slots for savepos/loadpos, indexed like spheres
+Vector<Vec3> savedpos[3];
+
+const Vec3 &getsavedpos(int n, int idx)
 {
-    loopv(spheres)
-    {
-        Sphere &s = spheres[i];
-        s.oldpos = s.pos;
-    }
+    return savedpos[n][idx];
 }
 
-void clearmodel()
+void setsavedpos(int n, int idx, const Vec3 &pos)
 {
-    mname[0] = '\0';
-    mtris.setsize(0);
-    mverts.setsize(0);
-    mscale = 1;
-    moffset = 0;
-    joints.setsize(0);
-    selected[SEL_JOINT].setsize(0);
+    savedpos[n][idx] = pos;
 }
-COMMAND(clearmodel, "");
 
-void setupmodel(const char *fname)
+// every slot starts out at the position the sphere was created at
+Sphere &newsphere(const Sphere &s)
 {
-    printf("loaded %d joints from %s\n", joints.size(), fname);
-    loopv(joints)
-    {
-        Joint &j = joints[i];
-        if(j.used)
-        {
-            for(int parent = j.parent; joints.inrange(parent); parent = joints[parent].parent)
-                joints[parent].haschild = true;
-        }
-    }
-    int unused = 0;
-    loopv(joints)
+    loopk(3) savedpos[k].add(s.pos);
+    return spheres.add(s);
+}
+
+// undo history: each entry records only what a command changed
+struct SphereState
+{
+    Vec3 pos;
+    float size;
+    bool sticky, eye;
+
+    SphereState() {}
+    SphereState(const Sphere &s) : pos(s.pos), size(s.size), sticky(s.sticky), eye(s.eye) {}
+
+    bool operator==(const SphereState &o) const { return pos==o.pos && size==o.size && sticky==o.sticky && eye==o.eye; }
+    bool operator!=(const SphereState &o) const { return !(*this==o); }
+
+    void apply(Sphere &s) const
     {
-        Joint &j = joints[i];
-        if(j.used || j.hide) continue;
-        if(!j.haschild) j.hide = 1;
-        else
-        {
-            if(!unused) printf("unused joints: %s", j.name);
-            else printf(", %s", j.name);
-            unused++;
-        }
+        s.oldpos = s.pos = pos;
+        s.size = size;
+        s.sticky = sticky;
+        s.eye = eye;
     }
-    if(unused) putchar('\n');
-    int hideused = 0;
-    loopv(joints)
+};
+
+struct SphereDelta
+{
+    int idx;
+    SphereState from, to;
+};
+
+struct RemovedSphere
+{
+    int idx;
+    Sphere sphere;
+    Vec3 saved[3];
+
+    RemovedSphere(int idx) : idx(idx), sphere(spheres[idx])
     {
-        Joint &j = joints[i];
-        if(j.hide && j.used)
-        {
-            if(!hideused) printf("using hidden joints: %s", j.name);
-            else printf(", %s", j.name);
-            hideused++;
-        }
+        loopk(3) saved[k] = savedpos[k][idx];
     }
-    if(hideused) putchar('\n');
-}
+};
 
-struct md5weight
+struct RemovedTri
 {
-    int joint;
-    float bias;
-    Vec3 pos;
+    int idx;
+    Tri tri;
+
+    RemovedTri(int idx) : idx(idx), tri(tris[idx]) {}
 };
 
-struct md5vert
+// constraints are kept as private copies, so the scene owns its own and the entry owns these
+struct ConstraintDelta
 {
-    float u, v;
-    int start, count;
+    int idx;
+    Constraint *from, *to;
 };
 
-void loadmd5(const char *fname, float scale)
+struct JointBind
+{
+    int tri, spheres[3];
+    Matrix3x4 tridiff;
+
+    JointBind() {}
+    JointBind(const Joint &j) : tri(j.tri), tridiff(j.tridiff) { loopk(3) spheres[k] = j.spheres[k]; }
+
+    bool operator==(const JointBind &o) const
+    {
+        return tri==o.tri && spheres[0]==o.spheres[0] && spheres[1]==o.spheres[1] && spheres[2]==o.spheres[2] &&
+            !memcmp(&tridiff, &o.tridiff, sizeof(tridiff));
+    }
+    bool operator!=(const JointBind &o) const { return !(*this==o); }
+
+    void apply(Joint &j) const
+    {
+        j.killbind();
+        if(tri < 0) return;
+        j.tri = tri;
+        loopk(3) j.spheres[k] = spheres[k];
+        j.tridiff = tridiff;
+    }
+};
+
+struct JointDelta
+{
+    int idx;
+    JointBind from, to;
+};
+
+// removals happen in the order constraints, tris, spheres, each followed by remapping the survivors
+struct UndoEntry
+{
+    Vector<SphereDelta> deltas;
+    Vector<RemovedSphere> removed;
+    Vector<RemovedTri> removedtris;
+    Vector<ConstraintDelta> removedconstraints, constraintdeltas;
+    Vector<JointDelta> jointdeltas;
+    int numspheres[2], numtris[2], numconstraints[2];
+    // appended elements are parked here while the entry is undone
+    Vector<Sphere> addedspheres;
+    Vector<Tri> addedtris;
+    Vector<Constraint *> addedconstraints;
+
+    UndoEntry()
+    {
+        numspheres[0] = numspheres[1] = spheres.size();
+        numtris[0] = numtris[1] = tris.size();
+        numconstraints[0] = numconstraints[1] = constraints.size();
+    }
+
+    ~UndoEntry()
+    {
+        loopv(removedconstraints) delete removedconstraints[i].from;
+        loopv(constraintdeltas) { delete constraintdeltas[i].from; delete constraintdeltas[i].to; }
+        loopv(addedconstraints) delete addedconstraints[i];
+    }
+
+    bool empty() const
+    {
+        return deltas.empty() && removed.empty() && removedtris.empty() && removedconstraints.empty() &&
+            constraintdeltas.empty() && jointdeltas.empty() &&
+            numspheres[0]==numspheres[1] && numtris[0]==numtris[1] && numconstraints[0]==numconstraints[1];
+    }
+
+    size_t memsize() const
+    {
+        return sizeof(UndoEntry) + deltas.size()*sizeof(SphereDelta) + removed.size()*sizeof(RemovedSphere) +
+            removedtris.size()*sizeof(RemovedTri) + removedconstraints.size()*(sizeof(ConstraintDelta) + sizeof(RotConstraint)) +
+            constraintdeltas.size()*(sizeof(ConstraintDelta) + 2*sizeof(RotConstraint)) + jointdeltas.size()*sizeof(JointDelta) +
+            addedspheres.size()*sizeof(Sphere) + addedtris.size()*sizeof(Tri) + addedconstraints.size()*sizeof(RotConstraint);
+    }
+
+    // elements appended by the command, as opposed to the survivors of any removals
+    int numadded(const int *num, int numremoved) const { return num[1] - num[0] + numremoved; }
+
+    void finish()
+    {
+        int n = 0;
+        loopv(deltas)
+        {
+            SphereDelta &d = deltas[i];
+            if(!spheres.inrange(d.idx)) continue;
+            d.to = SphereState(spheres[d.idx]);
+            if(d.to != d.from) deltas[n++] = d;
+        }
+        deltas.setsize(n);
+        n = 0;
+        loopv(jointdeltas)
+        {
+            JointDelta &d = jointdeltas[i];
+            if(!joints.inrange(d.idx)) continue;
+            d.to = JointBind(joints[d.idx]);
+            if(d.to != d.from) jointdeltas[n++] = d;
+        }
+        jointdeltas.setsize(n);
+        loopv(constraintdeltas)
+        {
+            ConstraintDelta &d = constraintdeltas[i];
+            d.to = constraints[d.idx]->copy();
+        }
+        numspheres[1] = spheres.size();
+        numtris[1] = tris.size();
+        numconstraints[1] = constraints.size();
+    }
+
+    void undo()
+    {
+        loopi(numadded(numconstraints, removedconstraints.size())) addedconstraints.add(constraints.pop());
+        addedconstraints.reverse();
+        int keeptris = tris.size() - numadded(numtris, removedtris.size());
+        for(int i = keeptris; i < tris.size(); i++) addedtris.add(tris[i]);
+        tris.setsize(keeptris);
+        int keepspheres = spheres.size() - numadded(numspheres, removed.size());
+        for(int i = keepspheres; i < spheres.size(); i++) addedspheres.add(spheres[i]);
+        if(spheres.size() > keepspheres)
+        {
+            spheres.setsize(keepspheres);
+            loopk(3) savedpos[k].setsize(keepspheres);
+        }
+        loopvrev(removed)
+        {
+            const RemovedSphere &r = removed[i];
+            spheres.insert(r.idx, r.sphere);
+            loopk(3) savedpos[k].insert(r.idx, r.saved[k]);
+            loopvj(tris) tris[j].unremap(SEL_SPHERE, r.idx);
+            loopvj(constraints) constraints[j]->unremap(SEL_SPHERE, r.idx);
+        }
+        loopvrev(removedtris)
+        {
+            const RemovedTri &r = removedtris[i];
+            loopvj(constraints) constraints[j]->unremap(SEL_TRI, r.idx);
+            tris.insert(r.idx, r.tri);
+        }
+        loopvrev(removedconstraints) constraints.insert(removedconstraints[i].idx, removedconstraints[i].from->copy());
+        loopvrev(constraintdeltas)
+        {
+            const ConstraintDelta &d = constraintdeltas[i];
+            delete constraints[d.idx];
+            constraints[d.idx] = d.from->copy();
+        }
+        loopvrev(jointdeltas) if(joints.inrange(jointdeltas[i].idx)) jointdeltas[i].from.apply(joints[jointdeltas[i].idx]);
+        loopvrev(deltas) deltas[i].from.apply(spheres[deltas[i].idx]);
+    }
+
+    void redo()
+    {
+        loopv(deltas) deltas[i].to.apply(spheres[deltas[i].idx]);
+        loopv(constraintdeltas)
+        {
+            const ConstraintDelta &d = constraintdeltas[i];
+            delete constraints[d.idx];
+            constraints[d.idx] = d.to->copy();
+        }
+        loopv(removedconstraints) delete constraints.remove(removedconstraints[i].idx);
+        loopv(removedtris)
+        {
+            int idx = removedtris[i].idx;
+            tris.remove(idx);
+            loopvj(constraints) constraints[j]->remap(SEL_TRI, idx);
+        }
+        loopv(removed)
+        {
+            int idx = removed[i].idx;
+            spheres.remove(idx);
+            loopk(3) savedpos[k].remove(idx);
+            loopvj(tris) tris[j].remap(SEL_SPHERE, idx);
+            loopvj(constraints) constraints[j]->remap(SEL_SPHERE, idx);
+        }
+        loopv(jointdeltas) if(joints.inrange(jointdeltas[i].idx)) jointdeltas[i].to.apply(joints[jointdeltas[i].idx]);
+        loopv(addedspheres) newsphere(addedspheres[i]);
+        loopv(addedtris) tris.add(addedtris[i]);
+        loopv(addedconstraints) constraints.add(addedconstraints[i]);
+        addedspheres.setsize(0);
+        addedtris.setsize(0);
+        addedconstraints.setsize(0);
+    }
+};
+
+Vector<UndoEntry *> undos, redos;
+UndoEntry *curundo = NULL;
+size_t undomem = 0;
+
+VAR(undomegs, 0, 5, 100);
+
+void clearredos()
+{
+    while(redos.size())
+    {
+        UndoEntry *u = redos.pop();
+        undomem -= u->memsize();
+        delete u;
+    }
+}
+
+void clearundos()
+{
+    delete curundo;
+    curundo = NULL;
+    while(undos.size()) delete undos.pop();
+    clearredos();
+    undomem = 0;
+}
+
+// joint binds belong to the model they were recorded on and can't be replayed onto another
+void dropjointundos()
+{
+    if(curundo) curundo->jointdeltas.setsize(0);
+    Vector<UndoEntry *> *lists[2] = { &undos, &redos };
+    loopk(2) loopv(*lists[k])
+    {
+        UndoEntry *u = (*lists[k])[i];
+        undomem -= u->memsize();
+        u->jointdeltas.setsize(0);
+        undomem += u->memsize();
+    }
+}
+
+// drops the oldest entries over budget, but never the one just recorded
+void pruneundos()
+{
+    size_t budget = size_t(undomegs)<<20;
+    int n = 0;
+    while(n < undos.size()-1 && undomem > budget)
+    {
+        undomem -= undos[n]->memsize();
+        delete undos[n++];
+    }
+    if(n) undos.remove(0, n);
+    if(undomegs && undomem > budget) conoutf(CON_WARN, "undo step uses %d KB, over the %d MB undo budget", int(undomem>>10), undomegs);
+}
+
+void endundo()
+{
+    if(!curundo) return;
+    UndoEntry *u = curundo;
+    curundo = NULL;
+    u->finish();
+    if(u->empty()) { delete u; return; }
+    clearredos();
+    undos.add(u);
+    undomem += u->memsize();
+    pruneundos();
+}
+
+void beginundo()
+{
+    if(replaying) return;
+    endundo();
+    curundo = new UndoEntry;
+}
+
+void undosphere(int idx)
+{
+    if(!curundo || !spheres.inrange(idx)) return;
+    SphereDelta &d = curundo->deltas.add();
+    d.idx = idx;
+    d.from = SphereState(spheres[idx]);
+}
+
+void undoremovesphere(int idx)
+{
+    if(curundo) curundo->removed.add(RemovedSphere(idx));
+}
+
+void undoremovetri(int idx)
+{
+    if(curundo) curundo->removedtris.add(RemovedTri(idx));
+}
+
+void undoremoveconstraint(int idx)
+{
+    if(!curundo) return;
+    ConstraintDelta &d = curundo->removedconstraints.add();
+    d.idx = idx;
+    d.from = constraints[idx]->copy();
+    d.to = NULL;
+}
+
+void undoconstraint(int idx)
+{
+    if(!curundo) return;
+    ConstraintDelta &d = curundo->constraintdeltas.add();
+    d.idx = idx;
+    d.from = constraints[idx]->copy();
+    d.to = NULL;
+}
+
+void undojoint(int idx)
+{
+    if(!curundo || !joints.inrange(idx)) return;
+    JointDelta &d = curundo->jointdeltas.add();
+    d.idx = idx;
+    d.from = JointBind(joints[idx]);
+}
+
+void undoredo(Vector<UndoEntry *> &from, Vector<UndoEntry *> &to, bool isundo)
+{
+    endundo();
+    if(from.empty()) { conoutf("nothing to %s", isundo ? "undo" : "redo"); return; }
+    dragging = -1;
+    loopk(MAXSEL) selected[k].setsize(0);
+    UndoEntry *u = from.pop();
+    undomem -= u->memsize();
+    if(isundo) u->undo(); else u->redo();
+    undomem += u->memsize();
+    loopv(tris) tris[i].calcorient();
+    loopv(joints) joints[i].dirty = true;
+    jointmapdirty = true;
+    to.add(u);
+    requestsnapshot();
+}
+
+ICOMMAND(undo, "", (), undoredo(undos, redos, true));
+ICOMMAND(redo, "", (), undoredo(redos, undos, false));
+
+void hover()
+{
+    PROFILE(PROF_HOVER);
+    hovertype = -1;
+    hoveridx = -1;
+    hoverdist = 0;
+    if(dragging >= 0) return;
+
+    float dist;
+    if(showspheres) loopv(spheres)
+    {
+        const Sphere &s = spheres[i];
+        if(s.intersect(campos, camdir, dist) && (hovertype < 0 || dist < hoverdist)) { hovertype = SEL_SPHERE; hoveridx = i; hoverdist = dist; }
+    }
+    if(showjoints) loopv(joints)
+    {
+        const Joint &j = joints[i];
+        if(!j.hide && j.intersect(campos, camdir, 0.1f, dist) && (hovertype < 0 || dist < hoverdist)) { hovertype = SEL_JOINT; hoveridx = i; hoverdist = dist; }
+    }
+    if(showtris) loopv(tris)
+    {
+        const Tri &t = tris[i];
+        if(t.intersect(campos, camdir, dist) && (hovertype < 0 || dist < hoverdist)) { hovertype = SEL_TRI; hoveridx = i; hoverdist = dist; }
+    }
+    hoverdist /= camscale;
+}
+
+ICOMMAND(gethoverdist, "", (), floatret(hoverdist));
+
+VAR(dbgselect, 0, 0, 1);
+
+void select()
+{
+    if(hovertype>=0 && (selected[hovertype].empty() || selected[hovertype].last()!=hoveridx))
+    {
+        static const char *names[MAXSEL] = { "sphere", "tri", "joint" };
+        if(dbgselect) conoutf("select: %s %d", names[hovertype], hoveridx);
+        selected[hovertype].add(hoveridx);
+        if(dragging>=0 && hovertype==SEL_SPHERE) spheres[hoveridx].dragoffset = spheres[hoveridx].pos - spheres[dragging].pos;
+    }
+}
+COMMAND(select, "");
+
+void selectall(int *type)
+{
+    switch(*type)
+    {
+        case 0: selected[SEL_SPHERE].setsize(0); loopv(spheres) selected[SEL_SPHERE].add(i); break;
+        case 1: selected[SEL_TRI].setsize(0); loopv(tris) selected[SEL_TRI].add(i); break;
+        case 2: selected[SEL_JOINT].setsize(0); loopv(joints) selected[SEL_JOINT].add(i); break;
+    }
+}
+COMMAND(selectall, "i");
+
+void cancelselect()
+{
+    loopk(MAXSEL) selected[k].setsize(0);
+}
+COMMAND(cancelselect, "");
+
+void drag(int *isdown)
+{
+    if(!*isdown)
+    {
+        if(dragging >= 0)
+        {
+            journalpos(dragging);
+            loopv(selected[SEL_SPHERE]) if(selected[SEL_SPHERE][i] != dragging) journalpos(selected[SEL_SPHERE][i]);
+            endundo();
+        }
+        dragging = -1;
+        return;
+    }
+    if(hovertype==SEL_SPHERE)
+    {
+        beginundo();
+        undosphere(hoveridx);
+        loopv(selected[SEL_SPHERE]) undosphere(selected[SEL_SPHERE][i]);
+        dragging = hoveridx;
+        dragdist = camera.origin.dist(spheres[hoveridx].pos)/camscale;
+        spheres[dragging].dragoffset = Vec3(0, 0, 0);
+
+        loopv(selected[SEL_SPHERE])
+        {
+            Sphere &s = spheres[selected[SEL_SPHERE][i]];
+            s.dragoffset = s.pos - spheres[dragging].pos;
+        }
+    }
+}
+COMMAND(drag, "D");
+
+int delcmp(const int *x, const int *y)
+{
+    if(*x > *y) return -1;
+    if(*x < *y) return 1;
+    return 0;
+}
+
+void delitems(Vector<int> &ds, Vector<int> &dt, Vector<int> &dj)
+{
+    Vector<int> dc;
+    loopv(ds)
+    {
+        if(dragging==ds[i]) dragging = -1;
+        loopvj(tris) if(tris[j].uses(SEL_SPHERE, ds[i]) && dt.find(j)<0) dt.add(j);
+        loopvj(joints) if(joints[j].uses(SEL_SPHERE, ds[i]) && dj.find(j)<0) dj.add(j);
+        loopvj(constraints) if(constraints[j]->uses(SEL_SPHERE, ds[i]) && dc.find(j)<0) dc.add(j);
+    }
+    loopv(dt)
+    {
+        loopvj(joints) if(joints[j].uses(SEL_TRI, dt[i]) && dj.find(j)<0) dj.add(j);
+        loopvj(constraints) if(constraints[j]->uses(SEL_TRI, dt[i]) && dc.find(j)<0) dc.add(j);
+    }
+    dc.sort(delcmp);
+    dj.sort(delcmp);
+    dt.sort(delcmp);
+    ds.sort(delcmp);
+    // any bind may be remapped; unchanged ones are dropped when the entry is finished
+    if(ds.size() || dt.size() || dj.size()) loopv(joints) undojoint(i);
+    // the order here is the one UndoEntry::redo replays
+    loopv(dc)
+    {
+        undoremoveconstraint(dc[i]);
+        delete constraints.remove(dc[i]);
+    }
+    loopv(dj) joints[dj[i]].killbind();
+    loopv(dt)
+    {
+        undoremovetri(dt[i]);
+        tris.remove(dt[i]);
+        loopvj(joints) joints[j].remap(SEL_TRI, dt[i]);
+        loopvj(constraints) constraints[j]->remap(SEL_TRI, dt[i]);
+    }
+    loopv(ds)
+    {
+        undoremovesphere(ds[i]);
+        spheres.remove(ds[i]);
+        loopk(3) savedpos[k].remove(ds[i]);
+        loopvj(tris) tris[j].remap(SEL_SPHERE, ds[i]);
+        loopvj(joints) joints[j].remap(SEL_SPHERE, ds[i]);
+        loopvj(constraints) constraints[j]->remap(SEL_SPHERE, ds[i]);
+    }
+}
+
+void delselect()
+{
+    Vector<int> ds, dt, dj;
+    loopv(selected[SEL_SPHERE]) ds.add(selected[SEL_SPHERE][i]);
+    loopv(selected[SEL_TRI]) dt.add(selected[SEL_TRI][i]);
+    loopv(selected[SEL_JOINT]) dj.add(selected[SEL_JOINT][i]);
+    if(FILE *f = journalfile())
+    {
+        fprintf(f, "x %d %d %d", ds.size(), dt.size(), dj.size());
+        loopv(ds) fprintf(f, " %d", ds[i]);
+        loopv(dt) fprintf(f, " %d", dt[i]);
+        loopv(dj) fprintf(f, " %d", dj[i]);
+        fputc('\n', f);
+        journalrecords++;
+    }
+    beginundo();
+    delitems(ds, dt, dj);
+    endundo();
+    loopk(3) selected[k].setsize(0);
+}
+COMMAND(delselect, "");
+
+void stopspheres()
+{
+    loopv(spheres)
+    {
+        Sphere &s = spheres[i];
+        s.oldpos = s.pos;
+    }
+}
+
+void clearmodel(bool keepundos = false)
+{
+    cancelmodelload();
+    stopskinworkers();
+    mname[0] = '\0';
+    mtris.setsize(0);
+    mverts.setsize(0);
+    mcurverts.setsize(0);
+    if(mvbo) { glDeleteBuffers_(1, &mvbo); mvbo = 0; }
+    if(mibo) { glDeleteBuffers_(1, &mibo); mibo = 0; }
+    jointvertoffsets.setsize(0);
+    jointverts.setsize(0);
+    dirtyverts.setsize(0);
+    loopk(3) skinpos[k].setsize(0);
+    loopk(4) { skinjoints[k].setsize(0); skinweights[k].setsize(0); }
+    mscale = 1;
+    moffset = 0;
+    joints.setsize(0);
+    jointorder.setsize(0);
+    jointmapdirty = true;
+    selected[SEL_JOINT].setsize(0);
+    if(keepundos) dropjointundos();
+    else clearundos();
+}
+ICOMMAND(clearmodel, "", (), { clearmodel(); journalf("M\n"); });
+
+void setupmodel(const char *fname, DiagLog &diag)
+{
+    conoutf("loaded %d joints from %s", joints.size(), fname);
+    calcjointorder();
+    jointmapdirty = true;
+    loopvrev(jointorder)
+    {
+        Joint &j = joints[jointorder[i]];
+        if((j.used || j.haschild) && joints.inrange(j.parent)) joints[j.parent].haschild = true;
+    }
+    loopv(joints)
+    {
+        Joint &j = joints[i];
+        if(j.used || j.hide) continue;
+        if(!j.haschild) j.hide = 1;
+        else diag.add("unused joints", "%s", j.name);
+    }
+    loopv(joints)
+    {
+        Joint &j = joints[i];
+        if(j.hide && j.used) diag.add("hidden joints in use", "%s", j.name);
+    }
+
+    jointvertoffsets.setsize(0);
+    loopi(joints.size()+1) jointvertoffsets.add(0);
+    loopv(mverts)
+    {
+        MVert &v = mverts[i];
+        loopj(4) if(v.weights[j] && joints.inrange(v.joints[j])) jointvertoffsets[v.joints[j]+1]++;
+    }
+    loopv(joints) jointvertoffsets[i+1] += jointvertoffsets[i];
+    Vector<int> fill;
+    loopv(joints) fill.add(jointvertoffsets[i]);
+    jointverts.setsize(0);
+    loopi(jointvertoffsets.last()) jointverts.add(0);
+    loopv(mverts)
+    {
+        MVert &v = mverts[i];
+        loopj(4) if(v.weights[j] && joints.inrange(v.joints[j])) jointverts[fill[v.joints[j]]++] = i;
+    }
+
+    loopk(3) skinpos[k].setsize(0);
+    loopk(4) { skinjoints[k].setsize(0); skinweights[k].setsize(0); }
+    loopv(mverts)
+    {
+        MVert &v = mverts[i];
+        loopk(3) skinpos[k].add(v.pos[k]);
+        loopk(4)
+        {
+            bool valid = v.weights[k] && joints.inrange(v.joints[k]);
+            skinjoints[k].add(valid ? v.joints[k] : 0);
+            skinweights[k].add(valid ? v.weights[k] : 0);
+        }
+    }
+
+    mcurverts.setsize(0);
+    dirtyverts.setsize(0);
+    loopv(mverts) { mverts[i].dirty = true; dirtyverts.add(i); mcurverts.add(Vec3(0, 0, 0)); }
+
+    diag.flush();
+}
+
+VARF(skinmode, 0, 0, 1, loopv(joints) joints[i].dirty = true);
+
+Matrix3x4 blenddualquats(const DualQuat *dqs, const int * const *sj, const float * const *sw, int v)
+{
+    const DualQuat &q0 = dqs[sj[0][v]];
+    DualQuat d;
+#ifdef __SSE__
+    __m128 real = _mm_setzero_ps(), dual = _mm_setzero_ps();
+    loopk(4)
+    {
+        const DualQuat &q = dqs[sj[k][v]];
+        __m128 w = _mm_set1_ps(k && q.real.dot(q0.real) < 0 ? -sw[k][v] : sw[k][v]);
+        real = _mm_add_ps(real, _mm_mul_ps(_mm_loadu_ps(q.real.v), w));
+        dual = _mm_add_ps(dual, _mm_mul_ps(_mm_loadu_ps(q.dual.v), w));
+    }
+    _mm_storeu_ps(d.real.v, real);
+    _mm_storeu_ps(d.dual.v, dual);
+#else
+    d.real = Quat(0, 0, 0, 0);
+    d.dual = Quat(0, 0, 0, 0);
+    loopk(4)
+    {
+        const DualQuat &q = dqs[sj[k][v]];
+        float w = k && q.real.dot(q0.real) < 0 ? -sw[k][v] : sw[k][v];
+        d.real += q.real*w;
+        d.dual += q.dual*w;
+    }
+#endif
+    if(d.real.dot(d.real) <= 0) return Matrix3x4(Vec4(0, 0, 0, 0), Vec4(0, 0, 0, 0), Vec4(0, 0, 0, 0));
+    return Matrix3x4(d);
+}
+
+void skinverts(const int *idx, int start, int end)
+{
+    const Matrix3x4 *mats = skinmats.getbuf();
+    const DualQuat *dqs = skindqs.getbuf();
+    const float *px = skinpos[0].getbuf(), *py = skinpos[1].getbuf(), *pz = skinpos[2].getbuf(), *sw[4];
+    const int *sj[4];
+    loopk(4) { sw[k] = skinweights[k].getbuf(); sj[k] = skinjoints[k].getbuf(); }
+    int i = start;
+#ifdef __SSE__
+    for(; i + 4 <= end; i += 4)
+    {
+        __m128 a[4], b[4], c[4];
+        loopk(4)
+        {
+            int v = idx[i+k];
+            if(skinmode)
+            {
+                Matrix3x4 m = blenddualquats(dqs, sj, sw, v);
+                a[k] = _mm_loadu_ps(m.a.v);
+                b[k] = _mm_loadu_ps(m.b.v);
+                c[k] = _mm_loadu_ps(m.c.v);
+                continue;
+            }
+            const Matrix3x4 &m0 = mats[sj[0][v]], &m1 = mats[sj[1][v]], &m2 = mats[sj[2][v]], &m3 = mats[sj[3][v]];
+            __m128 s0 = _mm_set1_ps(sw[0][v]), s1 = _mm_set1_ps(sw[1][v]), s2 = _mm_set1_ps(sw[2][v]), s3 = _mm_set1_ps(sw[3][v]);
+            #define BLENDROW(row) \
+                _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m0.row.v), s0), _mm_mul_ps(_mm_loadu_ps(m1.row.v), s1)), \
+                           _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m2.row.v), s2), _mm_mul_ps(_mm_loadu_ps(m3.row.v), s3)))
+            a[k] = BLENDROW(a);
+            b[k] = BLENDROW(b);
+            c[k] = BLENDROW(c);
+            #undef BLENDROW
+        }
+        _MM_TRANSPOSE4_PS(a[0], a[1], a[2], a[3]);
+        _MM_TRANSPOSE4_PS(b[0], b[1], b[2], b[3]);
+        _MM_TRANSPOSE4_PS(c[0], c[1], c[2], c[3]);
+        int v0 = idx[i], v1 = idx[i+1], v2 = idx[i+2], v3 = idx[i+3];
+        __m128 x = _mm_set_ps(px[v3], px[v2], px[v1], px[v0]),
+               y = _mm_set_ps(py[v3], py[v2], py[v1], py[v0]),
+               z = _mm_set_ps(pz[v3], pz[v2], pz[v1], pz[v0]);
+        #define TRANSFORMROW(r) \
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(r[0], x), _mm_mul_ps(r[1], y)), _mm_add_ps(_mm_mul_ps(r[2], z), r[3]))
+        float ox[4], oy[4], oz[4];
+        _mm_storeu_ps(ox, TRANSFORMROW(a));
+        _mm_storeu_ps(oy, TRANSFORMROW(b));
+        _mm_storeu_ps(oz, TRANSFORMROW(c));
+        #undef TRANSFORMROW
+        loopk(4) mcurverts[idx[i+k]] = Vec3(ox[k], oy[k], oz[k]);
+    }
+#endif
+    for(; i < end; i++)
+    {
+        int v = idx[i];
+        Vec3 p(px[v], py[v], pz[v]), r(0, 0, 0);
+        if(skinmode) r = blenddualquats(dqs, sj, sw, v).transform(p);
+        else loopk(4) if(sw[k][v]) r += mats[sj[k][v]].transform(p)*sw[k][v];
+        mcurverts[v] = r;
+    }
+}
+
+int numcpus()
+{
+    static int cpus = 0;
+    if(!cpus)
+    {
+#ifdef WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        cpus = max(int(info.dwNumberOfProcessors), 1);
+#else
+        cpus = max(int(sysconf(_SC_NPROCESSORS_ONLN)), 1);
+#endif
+    }
+    return cpus;
+}
+
+VAR(skinthreads, 0, 0, 64);
+VAR(skinthreadverts, 1, 4096, 1<<24);
+
+struct SkinWorker
+{
+    SDL_Thread *thread;
+    SDL_sem *start, *done;
+    const int *idx;
+    int begin, end;
+    bool stop;
+};
+Vector<SkinWorker *> skinworkers;
+
+int skinworker(void *data)
+{
+    SkinWorker *w = (SkinWorker *)data;
+    for(;;)
+    {
+        SDL_SemWait(w->start);
+        if(w->stop) break;
+        skinverts(w->idx, w->begin, w->end);
+        SDL_SemPost(w->done);
+    }
+    return 0;
+}
+
+void stopskinworkers()
+{
+    loopv(skinworkers)
+    {
+        SkinWorker *w = skinworkers[i];
+        w->stop = true;
+        SDL_SemPost(w->start);
+        SDL_WaitThread(w->thread, NULL);
+        SDL_DestroySemaphore(w->start);
+        SDL_DestroySemaphore(w->done);
+        delete w;
+    }
+    skinworkers.setsize(0);
+}
+
+void skinvertsthreaded(const int *idx, int num)
+{
+    int threads = min(skinthreads ? skinthreads : numcpus(), num/skinthreadverts);
+    if(threads <= 1) { skinverts(idx, 0, num); return; }
+    while(skinworkers.size() < threads-1)
+    {
+        SkinWorker *w = new SkinWorker;
+        w->stop = false;
+        w->start = SDL_CreateSemaphore(0);
+        w->done = SDL_CreateSemaphore(0);
+        w->thread = SDL_CreateThread(skinworker, w);
+        if(!w->thread)
+        {
+            SDL_DestroySemaphore(w->start);
+            SDL_DestroySemaphore(w->done);
+            delete w;
+            threads = skinworkers.size()+1;
+            break;
+        }
+        skinworkers.add(w);
+    }
+    int chunk = ((num + threads-1)/threads + 3)&~3;
+    loopi(threads-1)
+    {
+        SkinWorker *w = skinworkers[i];
+        w->idx = idx;
+        w->begin = min(i*chunk, num);
+        w->end = min((i+1)*chunk, num);
+        SDL_SemPost(w->start);
+    }
+    skinverts(idx, min((threads-1)*chunk, num), num);
+    loopi(threads-1) SDL_SemWait(skinworkers[i]->done);
+}
+
+void skinmodel()
+{
+    PROFILE(PROF_SKINNING);
+    loopv(joints)
+    {
+        Joint &j = joints[i];
+        if(!j.dirty || !jointvertoffsets.inrange(i+1)) continue;
+        j.dirty = false;
+        for(int k = jointvertoffsets[i], end = jointvertoffsets[i+1]; k < end; k++)
+        {
+            MVert &v = mverts[jointverts[k]];
+            if(!v.dirty) { v.dirty = true; dirtyverts.add(jointverts[k]); }
+        }
+    }
+    if(dirtyverts.empty()) return;
+    skinmats.setsize(0);
+    loopv(joints) skinmats.add(joints[i].orient);
+    if(skinmats.empty()) skinmats.add().identity();
+    skindqs.setsize(0);
+    if(skinmode) loopv(skinmats)
+    {
+        const Matrix3x4 &m = skinmats[i];
+        skindqs.add(DualQuat(Quat(m), Vec3(m.a.w, m.b.w, m.c.w)));
+    }
+    skinvertsthreaded(dirtyverts.getbuf(), dirtyverts.size());
+    loopv(dirtyverts)
+    {
+        int v = dirtyverts[i];
+        mverts[v].dirty = false;
+        mdirtymin = min(mdirtymin, v);
+        mdirtymax = max(mdirtymax, v);
+    }
+    dirtyverts.setsize(0);
+}
+
+void rendermodel()
+{
+    skinmodel();
+
+    glColor3f(0.5f, 0.5f, 0.5f);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    if(hasVBO && usevbo)
+    {
+        if(!mibo)
+        {
+            glGenBuffers_(1, &mibo);
+            glBindBuffer_(GL_ELEMENT_ARRAY_BUFFER_ARB, mibo);
+            glBufferData_(GL_ELEMENT_ARRAY_BUFFER_ARB, mtris.size()*sizeof(MTri), mtris.getbuf(), GL_STATIC_DRAW_ARB);
+        }
+        else glBindBuffer_(GL_ELEMENT_ARRAY_BUFFER_ARB, mibo);
+        if(!mvbo)
+        {
+            glGenBuffers_(1, &mvbo);
+            glBindBuffer_(GL_ARRAY_BUFFER_ARB, mvbo);
+            glBufferData_(GL_ARRAY_BUFFER_ARB, mcurverts.size()*sizeof(Vec3), mcurverts.getbuf(), GL_STREAM_DRAW_ARB);
+        }
+        else
+        {
+            glBindBuffer_(GL_ARRAY_BUFFER_ARB, mvbo);
+            if(mdirtymin <= mdirtymax)
+                glBufferSubData_(GL_ARRAY_BUFFER_ARB, mdirtymin*sizeof(Vec3), (mdirtymax - mdirtymin + 1)*sizeof(Vec3), &mcurverts[mdirtymin]);
+        }
+        mdirtymin = INT_MAX;
+        mdirtymax = -1;
+        glVertexPointer(3, GL_FLOAT, sizeof(Vec3), NULL);
+        glDrawElements(GL_TRIANGLES, 3*mtris.size(), GL_UNSIGNED_INT, NULL);
+        glBindBuffer_(GL_ARRAY_BUFFER_ARB, 0);
+        glBindBuffer_(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+    }
+    else
+    {
+        glVertexPointer(3, GL_FLOAT, sizeof(Vec3), mcurverts.getbuf());
+        glDrawElements(GL_TRIANGLES, 3*mtris.size(), GL_UNSIGNED_INT, mtris.getbuf());
+    }
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+}
+
+// mesh data as read from a model file, before it becomes the skinned model or collision geometry
+struct ModelData
+{
+    String name;
+    float scale, offset;
+    Vector<MTri> tris;
+    Vector<MVert> verts;
+    Vector<Joint> joints;
+    volatile int progress; // percent read, for loads running on a worker thread
+    volatile bool cancel;
+    DiagLog diag; // reported when the model is installed
+
+    ModelData() : scale(1), offset(0), progress(0), cancel(false) { name[0] = '\0'; }
+};
+
+struct md5weight
+{
+    int joint;
+    float bias;
+    Vec3 pos;
+};
+
+struct md5vert
+{
+    float u, v;
+    int start, count;
+};
+
+bool loadmd5(const char *fname, float scale, ModelData &md)
 {
     if(!fname[0]) fname = "model.md5mesh";
-    fname = path(fname, true);
+    String file;
+    fname = path(copystring(file, fname));
     FILE *f = fopen(fname, "r");
-    if(!f) { conoutf(CON_ERROR, "failed loading %s", fname); return; }
-    clearmodel();
-    copystring(mname, fname);
-    mscale = scale;
+    if(!f) { conoutf(CON_ERROR, "failed loading %s", fname); return false; }
+    md.diag.begin(fname);
+    copystring(md.name, fname);
+    md.scale = scale;
+    fseek(f, 0, SEEK_END);
+    long size = max(ftell(f), 1L);
+    fseek(f, 0, SEEK_SET);
     char buf[512];
     Vector<Matrix3x4> orients;
-    for(;;)
+    while(!md.cancel)
     {
+        md.progress = int(ftell(f)*100/size);
         fgets(buf, sizeof(buf), f);
         if(feof(f)) break;
         if(strstr(buf, "joints {"))
@@ -980,13 +2054,13 @@ void loadmd5(const char *fname, float scale)
                     while(isspace(*desc) || *desc=='"') desc++;
                     char *end = strchr(desc, '"');
                     if(end) *end = '\0';
-                    int index = joints.size();
-                    joints.add(Joint(desc, index, parent, pos * mscale));
+                    int index = md.joints.size();
+                    md.joints.add(Joint(desc, index, parent, pos * md.scale));
                     orients.add(Matrix3x4(Matrix3x3(orient), pos));
                 }
             }
-            loopv(joints) if(joints[i].pos.z < 1) moffset = max(moffset, 1 - joints[i].pos.z);
-            loopv(joints) joints[i].pos.z += moffset;
+            loopv(md.joints) if(md.joints[i].pos.z < 1) md.offset = max(md.offset, 1 - md.joints[i].pos.z);
+            loopv(md.joints) md.joints[i].pos.z += md.offset;
         }
         else if(strstr(buf, "mesh {"))
         {
@@ -997,8 +2071,9 @@ void loadmd5(const char *fname, float scale)
             md5vert v;
             MTri t;
             int index;
-            for(;;)
+            for(int lines = 0; !md.cancel; lines++)
             {
+                if(!(lines&0xFFF)) md.progress = int(ftell(f)*100/size);
                 fgets(buf, sizeof(buf), f);
                 if(buf[0]=='}' || feof(f)) break;
                 if(sscanf(buf, " vert %d ( %f %f ) %d %d", &index, &v.u, &v.v, &v.start, &v.count)==5)
@@ -1013,13 +2088,14 @@ void loadmd5(const char *fname, float scale)
                 {
                     w.pos.y = -w.pos.y;
                     if(index>=0) { while(!weights.inrange(index)) weights.add(w); weights[index] = w; }
-                    if(joints.inrange(w.joint)) joints[w.joint].used = true;
+                    if(md.joints.inrange(w.joint)) md.joints[w.joint].used = true;
                 }
             }
-            int mvoffset = mverts.size();
+            if(md.cancel) break; // the mesh was only partly read
+            int mvoffset = md.verts.size();
             loopv(tris)
             {
-                MTri &t = mtris.add(tris[i]);
+                MTri &t = md.tris.add(tris[i]);
                 loopk(3) t.vert[k] += mvoffset;
             }
             loopv(verts)
@@ -1029,12 +2105,12 @@ void loadmd5(const char *fname, float scale)
                 loopj(v.count)
                 {
                     md5weight &w = weights[v.start + j];
-                    if(joints.inrange(w.joint)) pos += orients[w.joint].transform(w.pos)*w.bias;
+                    if(md.joints.inrange(w.joint)) pos += orients[w.joint].transform(w.pos)*w.bias;
                 }
-                pos *= mscale;
-                pos.z += moffset;
+                pos *= md.scale;
+                pos.z += md.offset;
 
-                MVert &mv = mverts.add();
+                MVert &mv = md.verts.add();
                 mv.pos = pos;
                 memset(mv.weights, 0, sizeof(mv.weights));
                 memset(mv.joints, 0, sizeof(mv.joints));
@@ -1060,23 +2136,28 @@ void loadmd5(const char *fname, float scale)
                 if(total) loopj(4) mv.weights[j] /= total;
 
                 if(v.count > 4 || total < 0.999f || total > 1.001f)
-                    printf("vert %d: %d weights, %f sum\n", i, v.count, total);
+                {
+                    if(v.count > 4) md.diag.add("verts with more than 4 weights", "vert %d: %d weights, %f sum", i, v.count, total);
+                    else md.diag.add("verts with unnormalized weights", "vert %d: %d weights, %f sum", i, v.count, total);
+                }
             }
         }
     }
     fclose(f);
-    setupmodel(fname);
+    return !md.cancel;
 }
 
 #include "iqm.h"
 
-void loadiqm(const char *fname, float scale)
+bool loadiqm(const char *fname, float scale, ModelData &md)
 {
     uchar *buf = NULL;
     iqmheader hdr;
     Vector<Matrix3x4> orients;
     if(!fname[0]) fname = "model.iqm";
-    fname = path(fname, true);
+    String file;
+    fname = path(copystring(file, fname));
+    md.diag.begin(fname);
     FILE *f = fopen(fname, "rb");
     if(!f) goto error;
     if(fread(&hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr.magic, IQM_MAGIC, sizeof(hdr.magic)))
@@ -1091,10 +2172,11 @@ void loadiqm(const char *fname, float scale)
         goto error;
     if(hdr.num_meshes <= 0) goto error;
     fclose(f);
+    f = NULL;
+    md.progress = 50;
 
-    clearmodel();
-    copystring(mname, fname);
-    mscale = scale;
+    copystring(md.name, fname);
+    md.scale = scale;
 
     {
     lilswap((uint *)&buf[hdr.ofs_vertexarrays], hdr.num_vertexarrays*sizeof(iqmvertexarray)/sizeof(uint));
@@ -1132,62 +2214,359 @@ void loadiqm(const char *fname, float scale)
         orient.normalize();
         //if(j.parent >= 0) printf("%s -> %s\n", str+j.name, str+jdata[j.parent].name);
         //else printf("%s\n", str+j.name);
-        joints.add(Joint(&str[j.name], i, j.parent, (j.parent >= 0 ? orients[j.parent].transform(pos) : pos) * mscale));
+        md.joints.add(Joint(&str[j.name], i, j.parent, (j.parent >= 0 ? orients[j.parent].transform(pos) : pos) * md.scale));
         orients.add(Matrix3x4(Matrix3x3(orient), pos));
         if(j.parent >= 0) orients.last() = orients[j.parent] * orients.last();
-        if(joints.last().pos.z < 1) moffset = max(moffset, 1 - joints.last().pos.z);
+        if(md.joints.last().pos.z < 1) md.offset = max(md.offset, 1 - md.joints.last().pos.z);
+    }
+
+    loopi(hdr.num_meshes)
+    {
+        if(md.cancel) goto error;
+        md.progress = 50 + 50*i/hdr.num_meshes;
+        iqmmesh &m = mdata[i];
+        int mvoffset = md.verts.size();
+        loopj(m.num_triangles)
+        {
+            MTri &t = md.tris.add();
+            loopk(3) t.vert[k] = tdata[j + m.first_triangle].vertex[k] - m.first_vertex + mvoffset;
+        }
+        loopj(m.num_vertexes)
+        {
+            MVert &mv = md.verts.add();
+            mv.pos = Vec3(&vpos[3*(j + m.first_vertex)]);
+            mv.pos.y = -mv.pos.y;
+            mv.pos *= md.scale;
+            loopk(4)
+            {
+                mv.joints[k] = vindex[4*(j + m.first_vertex) + k];
+                mv.weights[k] = vweight[4*(j + m.first_vertex) + k]/255.0f;
+                if(mv.weights[k] && md.joints.inrange(mv.joints[k])) md.joints[mv.joints[k]].used = true;
+            }
+            if(mv.pos.z < 1) md.offset = max(md.offset, 1 - mv.pos.z);
+        }
+    }
+    loopv(md.verts) md.verts[i].pos.z += md.offset;
+    loopv(md.joints) md.joints[i].pos.z += md.offset;
+
+    }
+
+    delete[] buf;
+    return true;
+
+error:
+    if(f) fclose(f);
+    if(buf) delete[] buf;
+    if(!md.cancel) conoutf(CON_ERROR, "failed loading %s", fname);
+    return false;
+}
+
+bool loadmodeldata(const char *name, float scale, ModelData &md)
+{
+    const char *type = strrchr(name, '.');
+    if(!type) conoutf(CON_ERROR, "no file type");
+    else if(!strcasecmp(type, ".md5mesh")) return loadmd5(name, scale, md);
+    else if(!strcasecmp(type, ".iqm")) return loadiqm(name, scale, md);
+    else conoutf(CON_ERROR, "unknown file type: %s", type);
+    return false;
+}
+
+void installmodel(ModelData &md, bool keepundos = false)
+{
+    clearmodel(keepundos);
+    copystring(mname, md.name);
+    mscale = md.scale;
+    moffset = md.offset;
+    mtris = md.tris;
+    mverts = md.verts;
+    joints = md.joints;
+    setupmodel(mname, md.diag);
+}
+
+bool loadmodel(const char *name, float scale)
+{
+    ModelData md;
+    if(!loadmodeldata(name, scale, md)) return false;
+    installmodel(md);
+    return true;
+}
+
+// a model being read on a worker thread; the main loop swaps it in once the thread is done
+struct ModelLoad
+{
+    String name;
+    float scale;
+    bool journal;
+    ModelData md;
+    SDL_Thread *thread;
+    volatile bool done;
+    bool ok;
+    Vector<Joint> binds; // joint records that arrived with a scene, applied after the swap
+
+    ModelLoad(const char *name, float scale, bool journal) : scale(scale), journal(journal), thread(NULL), done(false), ok(false)
+    {
+        copystring(this->name, name);
+    }
+};
+
+ModelLoad *modelload = NULL;
+bool asyncscene = false;
+
+VAR(asyncload, 0, 1, 1);
+
+int modelloadworker(void *data)
+{
+    ModelLoad *l = (ModelLoad *)data;
+    l->ok = loadmodeldata(l->name, l->scale, l->md);
+    l->done = true;
+    SDL_Event event;
+    event.type = SDL_USEREVENT;
+    SDL_PushEvent(&event);
+    return 0;
+}
+
+void cancelmodelload()
+{
+    if(!modelload) return;
+    ModelLoad *l = modelload;
+    modelload = NULL;
+    l->md.cancel = true;
+    SDL_WaitThread(l->thread, NULL);
+    conoutf("cancelled loading %s", l->name);
+    delete l;
+}
+COMMAND(cancelmodelload, "");
+
+void startmodelload(const char *name, float scale, bool journal)
+{
+    cancelmodelload();
+    modelload = new ModelLoad(name, scale, journal);
+    modelload->thread = SDL_CreateThread(modelloadworker, modelload);
+    if(!modelload->thread)
+    {
+        delete modelload;
+        modelload = NULL;
+        if(loadmodel(name, scale) && journal) journalf("m %s %s\n", floatstr(scale), name);
+        return;
+    }
+    conoutf("loading %s", name);
+}
+
+ICOMMAND(modelloadprogress, "", (), intret(modelload ? modelload->md.progress : -1));
+
+void checkmodelload()
+{
+    if(!modelload || !modelload->done) return;
+    ModelLoad *l = modelload;
+    modelload = NULL;
+    SDL_WaitThread(l->thread, NULL);
+    if(l->ok)
+    {
+        // edits made while the model was loading stay undoable
+        installmodel(l->md, true);
+        loopv(l->binds)
+        {
+            const Joint &b = l->binds[i];
+            if(!joints.inrange(b.index) || !tris.inrange(b.tri)) continue;
+            Joint &j = joints[b.index];
+            j.tri = b.tri;
+            loopk(3) j.spheres[k] = spheres.inrange(b.spheres[k]) ? b.spheres[k] : -1;
+            j.tridiff = b.tridiff;
+        }
+        jointmapdirty = true;
+        if(l->journal) journalf("m %s %s\n", floatstr(l->scale), l->name);
+        requestsnapshot();
+    }
+    delete l;
+}
+
+ICOMMAND(loadmodel, "sf", (char *name, float *scale),
+{
+    float s = *scale > 0 ? *scale : 1;
+    if(asyncload) startmodelload(name, s, true);
+    else if(loadmodel(name, s)) journalf("m %s %s\n", floatstr(s), name);
+});
+
+ICOMMAND(getmodelscale, "", (), floatret(mscale));
+
+// static collision geometry: triangles of a second model in a BVH built once at load
+struct CollideTri
+{
+    Vec3 a, b, c;
+};
+
+struct CollideNode
+{
+    Vec3 bbmin, bbmax;
+    int child, numtris; // leaves hold tris [child, child+numtris), inner nodes have children child and child+1
+};
+
+struct CollisionModel
+{
+    enum { MAXLEAFTRIS = 4, MAXDEPTH = 64 };
+
+    String name;
+    Vector<CollideTri> tris;
+    Vector<CollideNode> nodes;
+
+    CollisionModel() { name[0] = '\0'; }
+
+    void clear()
+    {
+        name[0] = '\0';
+        tris.setsize(0);
+        nodes.setsize(0);
+    }
+
+    void calcbounds(CollideNode &n, int start, int num)
+    {
+        n.bbmin = n.bbmax = tris[start].a;
+        for(int i = start; i < start+num; i++) loopk(3)
+        {
+            const Vec3 &v = k==0 ? tris[i].a : (k==1 ? tris[i].b : tris[i].c);
+            loopj(3) { n.bbmin[j] = min(n.bbmin[j], v[j]); n.bbmax[j] = max(n.bbmax[j], v[j]); }
+        }
+    }
+
+    void buildnode(int idx, int start, int num, Vector<Vec3> &centers, int depth)
+    {
+        calcbounds(nodes[idx], start, num);
+        if(num <= MAXLEAFTRIS || depth >= MAXDEPTH-1) { nodes[idx].child = start; nodes[idx].numtris = num; return; }
+        Vec3 cmin = centers[start], cmax = centers[start];
+        for(int i = start+1; i < start+num; i++) loopj(3) { cmin[j] = min(cmin[j], centers[i][j]); cmax[j] = max(cmax[j], centers[i][j]); }
+        Vec3 extent = cmax - cmin;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        float split = (cmin[axis] + cmax[axis])*0.5f;
+        int left = start, right = start+num-1;
+        while(left <= right)
+        {
+            if(centers[left][axis] < split) left++;
+            else
+            {
+                swap(centers[left], centers[right]);
+                swap(tris[left], tris[right]);
+                right--;
+            }
+        }
+        int numleft = left - start;
+        if(numleft <= 0 || numleft >= num) numleft = num/2;
+        int child = nodes.size();
+        nodes.add();
+        nodes.add();
+        nodes[idx].child = child;
+        nodes[idx].numtris = 0;
+        buildnode(child, start, numleft, centers, depth+1);
+        buildnode(child+1, start+numleft, num-numleft, centers, depth+1);
     }
 
-    loopi(hdr.num_meshes)
+    void build(const ModelData &md)
     {
-        iqmmesh &m = mdata[i];
-        int mvoffset = mverts.size();
-        loopj(m.num_triangles)
+        clear();
+        copystring(name, md.name);
+        Vector<Vec3> centers;
+        loopv(md.tris)
         {
-            MTri &t = mtris.add();
-            loopk(3) t.vert[k] = tdata[j + m.first_triangle].vertex[k] - m.first_vertex + mvoffset;
+            const MTri &t = md.tris[i];
+            if(!md.verts.inrange(t.vert[0]) || !md.verts.inrange(t.vert[1]) || !md.verts.inrange(t.vert[2])) continue;
+            CollideTri &c = tris.add();
+            c.a = md.verts[t.vert[0]].pos;
+            c.b = md.verts[t.vert[1]].pos;
+            c.c = md.verts[t.vert[2]].pos;
+            // the loaders lift models to stand on the ground plane, but the environment keeps its own placement
+            c.a.z -= md.offset;
+            c.b.z -= md.offset;
+            c.c.z -= md.offset;
+            centers.add((c.a + c.b + c.c)/3);
         }
-        loopj(m.num_vertexes)
+        if(tris.empty()) return;
+        nodes.add();
+        buildnode(0, 0, tris.size(), centers, 0);
+    }
+
+    static Vec3 closestpoint(const Vec3 &p, const Vec3 &a, const Vec3 &b, const Vec3 &c)
+    {
+        Vec3 ab = b - a, ac = c - a, ap = p - a;
+        float d1 = ab.dot(ap), d2 = ac.dot(ap);
+        if(d1 <= 0 && d2 <= 0) return a;
+        Vec3 bp = p - b;
+        float d3 = ab.dot(bp), d4 = ac.dot(bp);
+        if(d3 >= 0 && d4 <= d3) return b;
+        float vc = d1*d4 - d3*d2;
+        if(vc <= 0 && d1 >= 0 && d3 <= 0) return a + ab*(d1/(d1 - d3));
+        Vec3 cp = p - c;
+        float d5 = ab.dot(cp), d6 = ac.dot(cp);
+        if(d6 >= 0 && d5 <= d6) return c;
+        float vb = d5*d2 - d1*d6;
+        if(vb <= 0 && d2 >= 0 && d6 <= 0) return a + ac*(d2/(d2 - d6));
+        float va = d3*d6 - d5*d4;
+        if(va <= 0 && d4 >= d3 && d5 >= d6) return b + (c - b)*((d4 - d3)/((d4 - d3) + (d5 - d6)));
+        float denom = 1/(va + vb + vc);
+        return a + ab*(vb*denom) + ac*(vc*denom);
+    }
+
+    // pushes the sphere out of every triangle it overlaps, returns whether it touched anything
+    bool collide(Vec3 &pos, float radius) const
+    {
+        if(nodes.empty()) return false;
+        bool hit = false;
+        int stack[MAXDEPTH+1], depth = 0;
+        stack[depth++] = 0;
+        while(depth > 0)
         {
-            MVert &mv = mverts.add();
-            mv.pos = Vec3(&vpos[3*(j + m.first_vertex)]);
-            mv.pos.y = -mv.pos.y;
-            mv.pos *= mscale;
-            loopk(4)
+            const CollideNode &n = nodes[stack[--depth]];
+            if(pos.x + radius < n.bbmin.x || pos.x - radius > n.bbmax.x ||
+               pos.y + radius < n.bbmin.y || pos.y - radius > n.bbmax.y ||
+               pos.z + radius < n.bbmin.z || pos.z - radius > n.bbmax.z)
+                continue;
+            if(!n.numtris)
             {
-                mv.joints[k] = vindex[4*(j + m.first_vertex) + k];
-                mv.weights[k] = vweight[4*(j + m.first_vertex) + k]/255.0f;
-                if(mv.weights[k] && joints.inrange(mv.joints[k])) joints[mv.joints[k]].used = true;
+                stack[depth++] = n.child;
+                stack[depth++] = n.child+1;
+                continue;
+            }
+            for(int i = n.child; i < n.child + n.numtris; i++)
+            {
+                const CollideTri &t = tris[i];
+                Vec3 dir = pos - closestpoint(pos, t.a, t.b, t.c);
+                float dist = dir.squaredlen();
+                if(dist >= radius*radius) continue;
+                dist = sqrtf(dist);
+                if(dist > 1e-6f) dir /= dist;
+                else dir = (t.b - t.a).cross(t.c - t.a).normalize();
+                pos += dir*(radius - dist);
+                hit = true;
             }
-            if(mv.pos.z < 1) moffset = max(moffset, 1 - mv.pos.z);
         }
+        return hit;
     }
-    loopv(mverts) mverts[i].pos.z += moffset;
-    loopv(joints) joints[i].pos.z += moffset;
-
-    setupmodel(fname);
 
+    void render()
+    {
+        if(tris.empty()) return;
+        glColor3f(0.3f, 0.4f, 0.3f);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(Vec3), tris.getbuf());
+        glDrawArrays(GL_TRIANGLES, 0, 3*tris.size());
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     }
+};
 
-    return;
+CollisionModel collision;
 
-error:
-    if(f) fclose(f);
-    if(buf) delete[] buf;
-    conoutf(CON_ERROR, "failed loading %s", fname);
-}
+VAR(showcollision, 0, 1, 1);
 
-void loadmodel(const char *name, float scale)
+void loadcollision(const char *name, float scale)
 {
-    const char *type = strrchr(name, '.');
-    if(!type) conoutf(CON_ERROR, "no file type");
-    else if(!strcasecmp(type, ".md5mesh")) loadmd5(name, scale);
-    else if(!strcasecmp(type, ".iqm")) loadiqm(name, scale);
-    else conoutf(CON_ERROR, "unknown file type: %s", type);
+    ModelData md;
+    if(!loadmodeldata(name, scale, md)) return;
+    md.diag.flush();
+    collision.build(md);
+    conoutf("loaded %d collision tris (%d nodes) from %s", collision.tris.size(), collision.nodes.size(), collision.name);
 }
-ICOMMAND(loadmodel, "sf", (char *name, float *scale), loadmodel(name, *scale > 0 ? *scale : 1));
-
-ICOMMAND(getmodelscale, "", (), floatret(mscale));
+ICOMMAND(loadcollision, "sf", (char *name, float *scale), loadcollision(name, *scale > 0 ? *scale : 1));
+ICOMMAND(clearcollision, "", (), collision.clear());
 ICOMMAND(getmodeloffset, "", (), floatret(moffset));
 
 void clearscene()
@@ -1199,24 +2578,160 @@ void clearscene()
     spheres.setsize(0);
     tris.setsize(0);
     while(constraints.size()) delete constraints.pop();
+    loopk(3) savedpos[k].setsize(0);
     clearmodel();
 }
-COMMAND(clearscene, "");
+ICOMMAND(clearscene, "", (), { clearscene(); requestsnapshot(); });
+
+#include "scene.h"
+
+static void writescenesection(Vector<uchar> &buf, uint type, uint count, const void *data, uint size)
+{
+    scenesection hdr;
+    hdr.type = type;
+    hdr.count = count;
+    hdr.size = (size + 3)&~3;
+    lilswap(&hdr.type, sizeof(hdr)/sizeof(uint));
+    buf.add((const uchar *)&hdr, sizeof(hdr));
+    buf.add((const uchar *)data, size);
+    while(buf.size()&3) buf.add(0);
+    ((sceneheader *)buf.getbuf())->num_sections++;
+}
+
+template<class T> static void writescenesection(Vector<uchar> &buf, uint type, Vector<T> &items)
+{
+    lilswap((uint *)items.getbuf(), items.size()*sizeof(T)/sizeof(uint));
+    writescenesection(buf, type, items.size(), items.getbuf(), items.size()*sizeof(T));
+}
+
+// builds the whole binary scene in memory, tagged with an autosave generation if non-zero
+void savescenebin(Vector<uchar> &f, uint generation = 0)
+{
+    sceneheader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    copystring(hdr.magic, SCENE_MAGIC, sizeof(hdr.magic));
+    hdr.version = SCENE_VERSION;
+    f.add((const uchar *)&hdr, sizeof(hdr));
+
+    Vector<scenecamera> cam;
+    scenecamera &c = cam.add();
+    loopk(3) c.origin[k] = camera.origin[k];
+    c.yaw = camera.yaw;
+    c.pitch = camera.pitch;
+    writescenesection(f, SCENE_CAMERA, cam);
+
+    Vector<scenesphere> ss;
+    loopv(spheres)
+    {
+        const Sphere &s = spheres[i];
+        scenesphere &d = ss.add();
+        loopk(3) d.pos[k] = s.pos[k];
+        d.size = max(s.size, 1.0f);
+        d.flags = (s.sticky ? SCENE_STICKY : 0) | (s.eye ? SCENE_EYE : 0);
+        loopj(3) loopk(3) d.saved[j][k] = getsavedpos(j, i)[k];
+    }
+    writescenesection(f, SCENE_SPHERES, ss);
+
+    Vector<scenetri> ts;
+    loopv(tris)
+    {
+        scenetri &d = ts.add();
+        d.sphere1 = tris[i].sphere1;
+        d.sphere2 = tris[i].sphere2;
+        d.sphere3 = tris[i].sphere3;
+    }
+    writescenesection(f, SCENE_TRIS, ts);
+
+    Vector<scenedist> ds;
+    Vector<scenerot> rs;
+    loopv(constraints) switch(constraints[i]->type())
+    {
+        case CONSTRAINT_DIST:
+        {
+            const DistConstraint &c = *(const DistConstraint *)constraints[i];
+            scenedist &d = ds.add();
+            d.index = i;
+            d.sphere1 = c.sphere1;
+            d.sphere2 = c.sphere2;
+            d.dist = c.dist;
+            break;
+        }
+        case CONSTRAINT_ROT:
+        {
+            const RotConstraint &c = *(const RotConstraint *)constraints[i];
+            scenerot &d = rs.add();
+            d.index = i;
+            d.tri1 = c.tri1;
+            d.tri2 = c.tri2;
+            d.maxangle = c.maxangle;
+            loopk(3) { d.middle[0][k] = c.middle.a[k]; d.middle[1][k] = c.middle.b[k]; d.middle[2][k] = c.middle.c[k]; }
+            break;
+        }
+    }
+    writescenesection(f, SCENE_DIST, ds);
+    writescenesection(f, SCENE_ROT, rs);
+
+    if(mname[0])
+    {
+        Vector<uchar> model;
+        scenemodel m;
+        m.scale = mscale;
+        lilswap((uint *)&m.scale, 1);
+        model.add((const uchar *)&m, sizeof(m));
+        model.add((const uchar *)mname, strlen(mname)+1);
+        writescenesection(f, SCENE_MODEL, 1, model.getbuf(), model.size());
+
+        Vector<scenejoint> js;
+        loopv(joints)
+        {
+            const Joint &j = joints[i];
+            if(j.tri<0) continue;
+            scenejoint &d = js.add();
+            d.index = j.index;
+            d.tri = j.tri;
+            loopk(3) d.spheres[k] = j.spheres[k];
+            loopk(4) { d.tridiff[0][k] = j.tridiff.a[k]; d.tridiff[1][k] = j.tridiff.b[k]; d.tridiff[2][k] = j.tridiff.c[k]; }
+        }
+        writescenesection(f, SCENE_JOINTS, js);
+    }
+
+    if(generation)
+    {
+        Vector<uint> gen;
+        gen.add(generation);
+        writescenesection(f, SCENE_GENERATION, gen);
+    }
+
+    sceneheader *h = (sceneheader *)f.getbuf();
+    lilswap(&h->version, 2);
+}
 
 void savescene(const char *fname)
 {
     if(!fname[0]) fname = "home/quicksave.txt";
     fname = path(fname, true);
-    FILE *f = fopen(fname, "w");
+    const char *ext = strrchr(fname, '.');
+    bool binary = ext && !strcasecmp(ext, ".rds");
+    FILE *f = fopen(fname, binary ? "wb" : "w");
     if(!f) { conoutf(CON_ERROR, "save failed"); return; }
-    fprintf(f, "c %f %f %f %f %f\n", camera.origin.x, camera.origin.y, camera.origin.z, camera.yaw, camera.pitch);
+    if(binary)
+    {
+        Vector<uchar> buf;
+        savescenebin(buf);
+        fwrite(buf.getbuf(), 1, buf.size(), f);
+        fclose(f);
+        conoutf("saved %s", fname);
+        return;
+    }
+    fprintf(f, "c %s %s %s %s %s\n", floatstr(camera.origin.x), floatstr(camera.origin.y), floatstr(camera.origin.z), floatstr(camera.yaw), floatstr(camera.pitch));
     loopv(spheres)
     {
         Sphere &s = spheres[i];
-        fprintf(f, "s %f %f %f %f %d", s.pos.x, s.pos.y, s.pos.z, max(s.size, 1.0f), s.sticky ? 1 : 0);
-        if(s.saved[0]!=s.pos || s.saved[1]!=s.pos || s.saved[2]!=s.pos) fprintf(f, " %f %f %f", s.saved[0].x, s.saved[0].y, s.saved[0].z);
-        if(s.saved[1]!=s.pos || s.saved[2]!=s.pos) fprintf(f, " %f %f %f", s.saved[1].x, s.saved[1].y, s.saved[1].z);
-        if(s.saved[2]!=s.pos) fprintf(f, " %f %f %f", s.saved[2].x, s.saved[2].y, s.saved[2].z);
+        fprintf(f, "s %s %s %s %s %d", floatstr(s.pos.x), floatstr(s.pos.y), floatstr(s.pos.z), floatstr(max(s.size, 1.0f)), s.sticky ? 1 : 0);
+        const Vec3 &s0 = getsavedpos(0, i), &s1 = getsavedpos(1, i), &s2 = getsavedpos(2, i);
+        if(s0!=s.pos || s1!=s.pos || s2!=s.pos) fprintf(f, " %s %s %s", floatstr(s0.x), floatstr(s0.y), floatstr(s0.z));
+        if(s1!=s.pos || s2!=s.pos) fprintf(f, " %s %s %s", floatstr(s1.x), floatstr(s1.y), floatstr(s1.z));
+        if(s2!=s.pos) fprintf(f, " %s %s %s", floatstr(s2.x), floatstr(s2.y), floatstr(s2.z));
         fprintf(f, "\n");
         if(s.eye) fprintf(f, "e %d\n", i);
     }
@@ -1228,7 +2743,7 @@ void savescene(const char *fname)
     loopv(constraints) constraints[i]->save(f);
     if(mname[0])
     {
-        fprintf(f, "m %f %s\n", mscale, mname);
+        fprintf(f, "m %s %s\n", floatstr(mscale), mname);
         loopv(joints) joints[i].save(f);
     }
     fclose(f);
@@ -1236,96 +2751,613 @@ void savescene(const char *fname)
 }
 COMMAND(savescene, "s");
 
-void loadscene(const char *fname)
+uint scenegeneration = 0;
+
+// puts a loaded constraint back at its saved position; empty or reused slots mean a corrupt file
+static bool placeconstraint(int first, int index, int limit, Constraint *c)
 {
-    if(!fname[0]) fname = "home/quicksave.txt";
-    fname = path(fname, true);
-    FILE *f = fopen(fname, "r");
-    if(!f) { conoutf(CON_ERROR, "load failed"); return; }
-    clearscene();
-    char buf[1024];
-    while(fgets(buf, sizeof(buf), f))
+    if(index < 0 || index >= limit) { delete c; return false; }
+    int idx = first + index;
+    while(constraints.size() <= idx) constraints.add(NULL);
+    if(constraints[idx]) { delete c; return false; }
+    constraints[idx] = c;
+    return true;
+}
+
+// sections are read in place; on little-endian hosts nothing is copied or swapped
+bool loadscenebin(uchar *buf, int len)
+{
+    int firstconstraint = constraints.size(), maxconstraints = len/int(sizeof(scenedist));
+    sceneheader &hdr = *(sceneheader *)buf;
+    lilswap(&hdr.version, 2);
+    if(hdr.version != SCENE_VERSION) return false;
+    uchar *cur = buf + sizeof(hdr), *end = buf + len;
+    loopi(hdr.num_sections)
     {
-        switch(buf[0])
+        if(end - cur < int(sizeof(scenesection))) return false;
+        scenesection &sec = *(scenesection *)cur;
+        lilswap(&sec.type, sizeof(sec)/sizeof(uint));
+        uchar *data = cur + sizeof(sec);
+        if(sec.size&3 || uint(end - data) < sec.size) return false;
+        cur = data + sec.size;
+        lilswap((uint *)data, sec.size/sizeof(uint));
+        #define SECTIONITEMS(T) \
+            if(sec.count > sec.size/sizeof(T)) return false; \
+            T *items = (T *)data;
+        switch(sec.type)
         {
-            case 'c':
+            case SCENE_CAMERA:
+            {
+                SECTIONITEMS(scenecamera);
+                if(!sec.count) break;
+                camera.origin = Vec3(items[0].origin[0], items[0].origin[1], items[0].origin[2]);
+                camera.yaw = items[0].yaw;
+                camera.pitch = items[0].pitch;
+                break;
+            }
+            case SCENE_SPHERES:
             {
-                float x, y, z, yaw, pitch;
-                if(sscanf(buf+1, " %f %f %f %f %f", &x, &y, &z, &yaw, &pitch) == 5)
+                SECTIONITEMS(scenesphere);
+                loopj(sec.count)
                 {
-                    camera.origin = Vec3(x, y, z);
-                    camera.yaw = yaw;
-                    camera.pitch = pitch;
+                    const scenesphere &d = items[j];
+                    Sphere &s = newsphere(Sphere(Vec3(d.pos[0], d.pos[1], d.pos[2]), max(d.size, 1.0f)));
+                    s.sticky = (d.flags&SCENE_STICKY) != 0;
+                    s.eye = (d.flags&SCENE_EYE) != 0;
+                    loopk(3) setsavedpos(k, spheres.size()-1, Vec3(d.saved[k][0], d.saved[k][1], d.saved[k][2]));
                 }
                 break;
             }
-            case 's':
+            case SCENE_TRIS:
             {
-                Vec3 pos, saved[3];
-                float sz;
-                int sticky = 0;
-                int num = sscanf(buf+1, " %f %f %f %f %d %f %f %f %f %f %f %f %f %f", &pos.x, &pos.y, &pos.z, &sz, &sticky, &saved[0].x, &saved[0].y, &saved[0].z, &saved[1].x, &saved[1].y, &saved[1].z, &saved[2].x, &saved[2].y, &saved[2].z);
-                if(num >= 4)
+                SECTIONITEMS(scenetri);
+                loopj(sec.count)
                 {
-                    Sphere &s = spheres.add(Sphere(pos, max(sz, 1.0f)));
-                    if(sticky) s.sticky = true;
-                    if(num >= 8) s.saved[0] = saved[0];
-                    if(num >= 11) s.saved[1] = saved[1];
-                    if(num >= 14) s.saved[2] = saved[2];
+                    const scenetri &d = items[j];
+                    if(!spheres.inrange(d.sphere1) || !spheres.inrange(d.sphere2) || !spheres.inrange(d.sphere3)) return false;
+                    tris.add(Tri(d.sphere1, d.sphere2, d.sphere3));
                 }
                 break;
             }
-            case 't':
+            case SCENE_DIST:
             {
-                int s1, s2, s3;
-                if(sscanf(buf+1, " %d %d %d", &s1, &s2, &s3)==3)
-                    tris.add(Tri(s1, s2, s3));
+                SECTIONITEMS(scenedist);
+                loopj(sec.count)
+                {
+                    if(!spheres.inrange(items[j].sphere1) || !spheres.inrange(items[j].sphere2)) return false;
+                    DistConstraint *c = new DistConstraint;
+                    c->sphere1 = items[j].sphere1;
+                    c->sphere2 = items[j].sphere2;
+                    c->dist = items[j].dist;
+                    if(!placeconstraint(firstconstraint, items[j].index, maxconstraints, c)) return false;
+                }
                 break;
             }
-            case 'd':
+            case SCENE_ROT:
             {
-                Constraint *c = new DistConstraint;
-                if(c->load(buf)) constraints.add(c);
-                else delete c;
+                SECTIONITEMS(scenerot);
+                loopj(sec.count)
+                {
+                    const scenerot &d = items[j];
+                    if(!tris.inrange(d.tri1) || !tris.inrange(d.tri2)) return false;
+                    RotConstraint *c = new RotConstraint;
+                    c->tri1 = d.tri1;
+                    c->tri2 = d.tri2;
+                    c->maxangle = d.maxangle;
+                    c->middle = Matrix3x3(Vec3(d.middle[0][0], d.middle[0][1], d.middle[0][2]),
+                                          Vec3(d.middle[1][0], d.middle[1][1], d.middle[1][2]),
+                                          Vec3(d.middle[2][0], d.middle[2][1], d.middle[2][2]));
+                    if(!placeconstraint(firstconstraint, d.index, maxconstraints, c)) return false;
+                }
                 break;
             }
-            case 'r':
+            case SCENE_MODEL:
             {
-                Constraint *c = new RotConstraint;
-                if(c->load(buf)) constraints.add(c);
-                else delete c;
+                if(sec.size <= sizeof(scenemodel) || data[sec.size-1]) return false;
+                float scale = ((scenemodel *)data)->scale;
+                if(asyncscene) startmodelload((const char *)data + sizeof(scenemodel), scale > 0 ? scale : 1, false);
+                else loadmodel((const char *)data + sizeof(scenemodel), scale > 0 ? scale : 1);
                 break;
             }
-            case 'm':
+            case SCENE_GENERATION:
             {
-                char *name = NULL;
-                float scale = strtod(buf+2, &name);
-                if(!name || !isspace(*name)) name = buf+2;
-                while(isspace(*name)) name++;
-                char *end = name;
-                while(*end && !isspace(*end)) end++;
-                *end = '\0';
-                loadmodel(name, scale > 0 ? scale : 1);
+                SECTIONITEMS(uint);
+                if(sec.count) scenegeneration = items[0];
                 break;
             }
-            case 'j':
+            case SCENE_JOINTS:
             {
-                int idx;
-                if(sscanf(buf+1, " %d", &idx)==1 && joints.inrange(idx)) joints[idx].load(buf);
+                SECTIONITEMS(scenejoint);
+                jointmapdirty = true;
+                loopj(sec.count)
+                {
+                    const scenejoint &d = items[j];
+                    if(d.tri >= 0 && !tris.inrange(d.tri)) return false;
+                    loopk(3) if(d.spheres[k] >= 0 && !spheres.inrange(d.spheres[k])) return false;
+                    if(modelload) modelload->binds.add(Joint("", d.index, -1, Vec3(0, 0, 0)));
+                    else if(!joints.inrange(d.index)) continue;
+                    Joint &jt = modelload ? modelload->binds.last() : joints[d.index];
+                    jt.tri = d.tri;
+                    loopk(3) jt.spheres[k] = d.spheres[k];
+                    jt.tridiff = Matrix3x4(Vec4(d.tridiff[0][0], d.tridiff[0][1], d.tridiff[0][2], d.tridiff[0][3]),
+                                           Vec4(d.tridiff[1][0], d.tridiff[1][1], d.tridiff[1][2], d.tridiff[1][3]),
+                                           Vec4(d.tridiff[2][0], d.tridiff[2][1], d.tridiff[2][2], d.tridiff[2][3]));
+                }
                 break;
             }
-            case 'e':
+        }
+        #undef SECTIONITEMS
+    }
+    for(int i = firstconstraint; i < constraints.size(); i++) if(!constraints[i]) return false;
+    return true;
+}
+
+void loadsceneline(char *buf)
+{
+    switch(buf[0])
+    {
+        case 'c':
+        {
+            float x, y, z, yaw, pitch;
+            if(sscanf(buf+1, " %f %f %f %f %f", &x, &y, &z, &yaw, &pitch) == 5)
+            {
+                camera.origin = Vec3(x, y, z);
+                camera.yaw = yaw;
+                camera.pitch = pitch;
+            }
+            break;
+        }
+        case 's':
+        {
+            Vec3 pos, saved[3];
+            float sz;
+            int sticky = 0;
+            int num = sscanf(buf+1, " %f %f %f %f %d %f %f %f %f %f %f %f %f %f", &pos.x, &pos.y, &pos.z, &sz, &sticky, &saved[0].x, &saved[0].y, &saved[0].z, &saved[1].x, &saved[1].y, &saved[1].z, &saved[2].x, &saved[2].y, &saved[2].z);
+            if(num >= 4)
             {
-                int idx;
-                if(sscanf(buf+1, " %d", &idx)==1 && spheres.inrange(idx)) spheres[idx].eye = true;
-                break;
+                Sphere &s = newsphere(Sphere(pos, max(sz, 1.0f)));
+                if(sticky) s.sticky = true;
+                if(num >= 8) setsavedpos(0, spheres.size()-1, saved[0]);
+                if(num >= 11) setsavedpos(1, spheres.size()-1, saved[1]);
+                if(num >= 14) setsavedpos(2, spheres.size()-1, saved[2]);
+            }
+            break;
+        }
+        case 't':
+        {
+            int s1, s2, s3;
+            if(sscanf(buf+1, " %d %d %d", &s1, &s2, &s3)==3)
+                tris.add(Tri(s1, s2, s3));
+            break;
+        }
+        case 'd':
+        {
+            Constraint *c = new DistConstraint;
+            if(c->load(buf)) constraints.add(c);
+            else delete c;
+            break;
+        }
+        case 'r':
+        {
+            Constraint *c = new RotConstraint;
+            if(c->load(buf)) constraints.add(c);
+            else delete c;
+            break;
+        }
+        case 'm':
+        {
+            char *name = NULL;
+            float scale = strtod(buf+2, &name);
+            if(!name || !isspace(*name)) name = buf+2;
+            while(isspace(*name)) name++;
+            char *end = name;
+            while(*end && !isspace(*end)) end++;
+            *end = '\0';
+            if(asyncscene) startmodelload(name, scale > 0 ? scale : 1, false);
+            else loadmodel(name, scale > 0 ? scale : 1);
+            break;
+        }
+        case 'j':
+        {
+            int idx;
+            if(sscanf(buf+1, " %d", &idx)!=1) break;
+            if(modelload) modelload->binds.add(Joint("", idx, -1, Vec3(0, 0, 0))).load(buf);
+            else if(joints.inrange(idx)) joints[idx].load(buf);
+            break;
+        }
+        case 'e':
+        {
+            int idx;
+            if(sscanf(buf+1, " %d", &idx)==1 && spheres.inrange(idx)) spheres[idx].eye = true;
+            break;
+        }
+    }
+}
+
+bool loadscenefile(const char *fname)
+{
+    int len = 0;
+    char *buf = loadfile(fname, &len);
+    if(!buf) return false;
+    clearscene();
+    if(len >= int(sizeof(sceneheader)) && !memcmp(buf, SCENE_MAGIC, sizeof(SCENE_MAGIC)))
+    {
+        if(!loadscenebin((uchar *)buf, len))
+        {
+            clearscene();
+            delete[] buf;
+            conoutf(CON_ERROR, "corrupt scene %s", fname);
+            return false;
+        }
+    }
+    else for(char *line = buf; line;)
+    {
+        char *next = strchr(line, '\n');
+        if(next) *next++ = '\0';
+        loadsceneline(line);
+        line = next;
+    }
+    delete[] buf;
+    return true;
+}
+
+void loadscene(const char *fname)
+{
+    if(!fname[0]) fname = "home/quicksave.txt";
+    fname = path(fname, true);
+    asyncscene = asyncload!=0;
+    bool loaded = loadscenefile(fname);
+    asyncscene = false;
+    if(!loaded) { conoutf(CON_ERROR, "load failed"); return; }
+    conoutf("loaded %s", fname);
+    requestsnapshot();
+}
+COMMAND(loadscene, "s");
+
+#ifndef WIN32
+#include <dirent.h>
+#include <signal.h>
+#include <errno.h>
+#endif
+
+// every instance autosaves under its own pid, so concurrent editors never share files
+struct AutosaveFiles
+{
+    int pid;
+    String snapshot, snapshottmp, journal, journalprev;
+
+    void init(int owner)
+    {
+        pid = owner;
+        printstring(snapshot)("home/autosave-%d.rds", pid);
+        printstring(snapshottmp)("home/autosave-%d.rds.tmp", pid);
+        printstring(journal)("home/autosave-%d.log", pid);
+        printstring(journalprev)("home/autosave-%d.log.prev", pid);
+    }
+
+    void removeall()
+    {
+        remove(journal);
+        remove(journalprev);
+        remove(snapshot);
+        remove(snapshottmp);
+    }
+};
+
+AutosaveFiles autosavefiles, recoveredfiles;
+
+int getautosavepid()
+{
+#ifdef WIN32
+    return int(GetCurrentProcessId());
+#else
+    return int(getpid());
+#endif
+}
+
+bool autosaveowneralive(int pid)
+{
+#ifdef WIN32
+    HANDLE h = OpenProcess(PROCESS_QUERY_INFORMATION, FALSE, DWORD(pid));
+    if(!h) return GetLastError() == ERROR_ACCESS_DENIED;
+    DWORD code = 0;
+    bool alive = GetExitCodeProcess(h, &code) && code == STILL_ACTIVE;
+    CloseHandle(h);
+    return alive;
+#else
+    return !kill(pid, 0) || errno == EPERM;
+#endif
+}
+
+// finds autosaves left behind by instances that are no longer running
+void findorphanedautosaves(Vector<int> &pids)
+{
+#ifdef WIN32
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile("home\\autosave-*", &data);
+    if(h == INVALID_HANDLE_VALUE) return;
+    do
+    {
+        const char *name = data.cFileName;
+#else
+    DIR *d = opendir("home");
+    if(!d) return;
+    for(dirent *e; (e = readdir(d));)
+    {
+        const char *name = e->d_name;
+#endif
+        int pid = 0, len = 0;
+        if(sscanf(name, "autosave-%d.%n", &pid, &len) < 1 || !len || pid <= 0 || pids.find(pid) >= 0) continue;
+        if(pid == autosavefiles.pid || !autosaveowneralive(pid)) pids.add(pid);
+#ifdef WIN32
+    }
+    while(FindNextFile(h, &data));
+    FindClose(h);
+#else
+    }
+    closedir(d);
+#endif
+}
+
+struct SnapshotJob
+{
+    Vector<uchar> buf;
+    volatile bool done, ok;
+
+    SnapshotJob() : done(false), ok(false) {}
+};
+
+SnapshotJob *snapshotjob = NULL;
+SDL_Thread *snapshotthread = NULL;
+uint journalgen = 0;
+int lastsnapshot = 0, flushedrecords = 0;
+
+// writes the snapshot beside the old one and swaps it in, after which the previous journal is redundant
+int snapshotworker(void *data)
+{
+    SnapshotJob *job = (SnapshotJob *)data;
+    FILE *f = fopen(autosavefiles.snapshottmp, "wb");
+    if(f)
+    {
+        bool ok = fwrite(job->buf.getbuf(), 1, job->buf.size(), f) == size_t(job->buf.size());
+        if(fclose(f)) ok = false;
+#ifdef WIN32
+        if(ok) remove(autosavefiles.snapshot);
+#endif
+        if(ok && !rename(autosavefiles.snapshottmp, autosavefiles.snapshot))
+        {
+            remove(autosavefiles.journalprev);
+            job->ok = true;
+        }
+    }
+    job->done = true;
+    return 0;
+}
+
+bool waitsnapshot(bool block)
+{
+    if(!snapshotjob) return true;
+    if(!block && !snapshotjob->done) return false;
+    if(snapshotthread) SDL_WaitThread(snapshotthread, NULL);
+    snapshotthread = NULL;
+    if(!snapshotjob->ok) conoutf(CON_WARN, "failed writing %s", autosavefiles.snapshot);
+    else if(recoveredfiles.pid > 0)
+    {
+        // the recovered scene now lives in our own snapshot
+        recoveredfiles.removeall();
+        recoveredfiles.pid = 0;
+    }
+    delete snapshotjob;
+    snapshotjob = NULL;
+    return true;
+}
+
+void compactjournal()
+{
+    if(!waitsnapshot(false)) { snapshotrequested = true; return; }
+    if(journal)
+    {
+        fclose(journal);
+#ifdef WIN32
+        remove(autosavefiles.journalprev);
+#endif
+        if(rename(autosavefiles.journal, autosavefiles.journalprev))
+        {
+            // never truncate the only journal; keep appending to it and retry on the next interval
+            conoutf(CON_WARN, "failed rotating %s", autosavefiles.journal);
+            journal = fopen(autosavefiles.journal, "a");
+            if(journal)
+            {
+                journalrecords = flushedrecords = 0;
+                snapshotrequested = false;
+                lastsnapshot = lastmillis;
+                return;
+            }
+        }
+    }
+    snapshotjob = new SnapshotJob;
+    savescenebin(snapshotjob->buf, ++journalgen);
+    journal = fopen(autosavefiles.journal, "w");
+    if(journal)
+    {
+        fprintf(journal, "g %u\n", journalgen);
+        fflush(journal);
+    }
+    else conoutf(CON_WARN, "failed writing %s", autosavefiles.journal);
+    journalrecords = flushedrecords = 0;
+    journaldirty = snapshotrequested = false;
+    lastsnapshot = lastmillis;
+    snapshotthread = SDL_CreateThread(snapshotworker, snapshotjob);
+    if(!snapshotthread) snapshotworker(snapshotjob);
+}
+
+void stopautosave()
+{
+    waitsnapshot(true);
+    if(journal) { fclose(journal); journal = NULL; }
+    autosavefiles.removeall();
+}
+
+VARF(autosave, 0, 1, 1, { if(!autosave) stopautosave(); else if(!journal) compactjournal(); });
+VAR(autosaveinterval, 1, 30, 3600);
+VAR(autosaverecords, 1, 1000, 1000000);
+
+int autosavewake()
+{
+    if(!journal) return -1;
+    if(snapshotrequested) return 0;
+    if(!journalrecords && !journaldirty) return -1;
+    return max(lastsnapshot + autosaveinterval*1000 - lastmillis, 0);
+}
+
+void checkautosave()
+{
+    if(!journal) return;
+    if(animmode || dragging >= 0) journaldirty = true;
+    if(journalrecords != flushedrecords)
+    {
+        fflush(journal);
+        flushedrecords = journalrecords;
+    }
+    if(modelload) return; // the scene isn't complete until the model is swapped in
+    if(snapshotrequested || journalrecords >= autosaverecords ||
+       ((journalrecords || journaldirty) && lastmillis - lastsnapshot >= autosaveinterval*1000))
+        compactjournal();
+}
+
+void delitems(Vector<int> &ds, Vector<int> &dt, Vector<int> &dj);
+
+// the two elements a constraint links, so journal records can name it by content as well as by index
+void constraintlinks(Constraint *c, int &a, int &b)
+{
+    if(c->type()==CONSTRAINT_DIST) { a = ((DistConstraint *)c)->sphere1; b = ((DistConstraint *)c)->sphere2; }
+    else { a = ((RotConstraint *)c)->tri1; b = ((RotConstraint *)c)->tri2; }
+}
+
+bool matchconstraint(int idx, int type, int a, int b)
+{
+    if(!constraints.inrange(idx) || constraints[idx]->type() != type) return false;
+    int ca, cb;
+    constraintlinks(constraints[idx], ca, cb);
+    return ca==a && cb==b;
+}
+
+void replayjournalline(char *line)
+{
+    switch(line[0])
+    {
+        case 'p':
+        {
+            int idx;
+            Vec3 pos;
+            if(sscanf(line+1, " %d %f %f %f", &idx, &pos.x, &pos.y, &pos.z)==4 && spheres.inrange(idx))
+                spheres[idx].oldpos = spheres[idx].pos = pos;
+            break;
+        }
+        case 'z':
+        {
+            int idx;
+            float size;
+            if(sscanf(line+1, " %d %f", &idx, &size)==2 && spheres.inrange(idx)) spheres[idx].size = max(size, 1.0f);
+            break;
+        }
+        case 'k':
+        {
+            int idx, sticky;
+            if(sscanf(line+1, " %d %d", &idx, &sticky)==2 && spheres.inrange(idx)) spheres[idx].sticky = sticky!=0;
+            break;
+        }
+        case 'E':
+        {
+            int idx;
+            if(sscanf(line+1, " %d", &idx)==1 && spheres.inrange(idx))
+            {
+                loopv(spheres) spheres[i].eye = false;
+                spheres[idx].eye = true;
+            }
+            break;
+        }
+        case 'y':
+        {
+            int idx, type, a, b, num = sscanf(line+1, " %d %d %d %d", &idx, &type, &a, &b);
+            if(num < 1) break;
+            if(num==4 && !matchconstraint(idx, type, a, b))
+            {
+                idx = -1;
+                loopv(constraints) if(matchconstraint(i, type, a, b)) { idx = i; break; }
+                if(idx < 0) { conoutf(CON_WARN, "journal deletes a constraint that is not in the scene"); break; }
             }
+            if(constraints.inrange(idx)) delete constraints.remove(idx);
+            break;
         }
+        case 'x':
+        {
+            Vector<int> del[3];
+            char *p = line+1;
+            int num[3];
+            loopk(3) num[k] = strtol(p, &p, 10);
+            loopk(3) loopi(num[k]) del[k].add(strtol(p, &p, 10));
+            delitems(del[SEL_SPHERE], del[SEL_TRI], del[SEL_JOINT]);
+            break;
+        }
+        case 'M':
+            clearmodel();
+            break;
+        default:
+            loadsceneline(line);
+            break;
+    }
+}
+
+bool replayjournal(const char *fname, uint base)
+{
+    char *buf = loadfile(fname);
+    if(!buf) return false;
+    uint gen = 0;
+    char *line = strchr(buf, '\n');
+    if(sscanf(buf, "g %u", &gen)!=1 || gen < base || !line) { delete[] buf; return false; }
+    journalgen = max(journalgen, gen);
+    for(line++; line;)
+    {
+        char *next = strchr(line, '\n');
+        if(next) *next++ = '\0';
+        replayjournalline(line);
+        line = next;
     }
-    fclose(f);
-    conoutf("loaded %s", fname);
+    delete[] buf;
+    return true;
+}
+
+void recoverautosave(const AutosaveFiles &files)
+{
+    replaying = true;
+    scenegeneration = 0;
+    if(!loadscenefile(files.snapshot) && !loadscenefile(files.snapshottmp)) clearscene();
+    journalgen = scenegeneration;
+    int replayed = 0;
+    if(replayjournal(files.journalprev, scenegeneration)) replayed++;
+    if(replayjournal(files.journal, scenegeneration)) replayed++;
+    replaying = false;
+    conoutf("recovered autosave generation %u (%d journals replayed)", journalgen, replayed);
+}
+
+void initautosave()
+{
+    autosavefiles.init(getautosavepid());
+    Vector<int> orphans;
+    findorphanedautosaves(orphans);
+    // recover one orphan per launch; the rest are left for the next one
+    if(orphans.size())
+    {
+        AutosaveFiles files;
+        files.init(orphans[0]);
+        conoutf(CON_WARN, "found autosave from an unclean shutdown of process %d", files.pid);
+        recoverautosave(files);
+        // our own files are simply overwritten; another instance's are removed once our snapshot is written
+        if(files.pid != autosavefiles.pid) recoveredfiles = files;
+    }
+    if(autosave) compactjournal();
 }
-COMMAND(loadscene, "s");
 
 VARF(cursormode, 0, 1, 1,
     if(cursormode)
@@ -1366,6 +3398,8 @@ COMMAND(unhidejoints, "");
 
 void addsphere(int *dir, float *dist)
 {
+    int numspheres = spheres.size();
+    beginundo();
     Vec3 pos = campos + camdir*spawndist*camscale;
     if(hovertype==SEL_JOINT)
     {
@@ -1381,28 +3415,30 @@ void addsphere(int *dir, float *dist)
         case 1: // relative X axis
         {
             Vec3 sep(radians(yaw+90), 0);
-            spheres.add(Sphere(pos-sep*sepdist, size));
-            spheres.add(Sphere(pos+sep*sepdist, size));
+            newsphere(Sphere(pos-sep*sepdist, size));
+            newsphere(Sphere(pos+sep*sepdist, size));
             break;
         }
         case 2: // relative Y axis
         {
             Vec3 sep(radians(yaw), radians(pitch));
-            spheres.add(Sphere(pos-sep*sepdist, size));
-            spheres.add(Sphere(pos+sep*sepdist, size));
+            newsphere(Sphere(pos-sep*sepdist, size));
+            newsphere(Sphere(pos+sep*sepdist, size));
             break;
         }
         case 3: // relative Z axis
         {
             Vec3 sep(radians(yaw), radians(pitch+90));
-            spheres.add(Sphere(pos-sep*sepdist, size));
-            spheres.add(Sphere(pos+sep*sepdist, size));
+            newsphere(Sphere(pos-sep*sepdist, size));
+            newsphere(Sphere(pos+sep*sepdist, size));
             break;
         }
         default:
-            spheres.add(Sphere(pos, size));
+            newsphere(Sphere(pos, size));
             break;
     }
+    for(int i = numspheres; i < spheres.size(); i++) journalsphere(i);
+    endundo();
 }
 COMMAND(addsphere, "if");
 
@@ -1425,8 +3461,14 @@ void setspheredist(float *dist, int *dir)
             case 2: axis = Vec3(radians(yaw), radians(pitch)); break;
             case 3: axis = Vec3(radians(yaw), radians(pitch+90)); break;
         }
+        beginundo();
+        undosphere(selected[SEL_SPHERE][0]);
+        undosphere(selected[SEL_SPHERE][1]);
         s1.pos = center - axis*sepdist;
         s2.pos = center + axis*sepdist;
+        endundo();
+        journalpos(selected[SEL_SPHERE][0]);
+        journalpos(selected[SEL_SPHERE][1]);
     }
 }
 COMMAND(setspheredist, "fi");
@@ -1451,11 +3493,15 @@ void rotspheres(float *angle, int *dir, int *numcenter)
             if(*numcenter<=0) center = (spheres[selected[SEL_SPHERE][0]].pos +  spheres[selected[SEL_SPHERE][1]].pos) / 2;
             break;
     }
+    beginundo();
     loopv(selected[SEL_SPHERE])
     {
         Sphere &s = spheres[selected[SEL_SPHERE][i]];
+        undosphere(selected[SEL_SPHERE][i]);
         s.pos = (s.pos - center).rotate(radians(*angle), axis) + center;
+        journalpos(selected[SEL_SPHERE][i]);
     }
+    endundo();
 }
 COMMAND(rotspheres, "fii");
 
@@ -1463,8 +3509,12 @@ void seteye()
 {
     if(selected[SEL_SPHERE].size() >= 1)
     {
-        loopv(spheres) if(spheres[i].eye) spheres[i].eye = false;
+        beginundo();
+        loopv(spheres) if(spheres[i].eye) { undosphere(i); spheres[i].eye = false; }
+        undosphere(selected[SEL_SPHERE][0]);
         spheres[selected[SEL_SPHERE][0]].eye = true;
+        endundo();
+        journalf("E %d\n", selected[SEL_SPHERE][0]);
     }
     selected[SEL_SPHERE].setsize(0);
 }
@@ -1472,7 +3522,15 @@ COMMAND(seteye, "");
 
 void setsize(float *size)
 {
-    loopv(selected[SEL_SPHERE]) spheres[selected[SEL_SPHERE][i]].size = max(*size, 1.0f);
+    beginundo();
+    loopv(selected[SEL_SPHERE])
+    {
+        int idx = selected[SEL_SPHERE][i];
+        undosphere(idx);
+        spheres[idx].size = max(*size, 1.0f);
+        journalf("z %d %s\n", idx, floatstr(spheres[idx].size));
+    }
+    endundo();
     selected[SEL_SPHERE].setsize(0);
 }
 COMMAND(setsize, "f");
@@ -1486,13 +3544,19 @@ COMMAND(stepanim, "");
 
 void invertsticky()
 {
-    loopv(spheres) spheres[i].sticky = !spheres[i].sticky;
+    beginundo();
+    loopv(spheres) { undosphere(i); spheres[i].sticky = !spheres[i].sticky; }
+    endundo();
+    requestsnapshot();
 }
 COMMAND(invertsticky, "");
 
 void setsticky(int *n)
 {
-    loopv(spheres) spheres[i].sticky = *n>0;
+    beginundo();
+    loopv(spheres) { undosphere(i); spheres[i].sticky = *n>0; }
+    endundo();
+    requestsnapshot();
 }
 COMMAND(setsticky, "i");
 
@@ -1502,9 +3566,21 @@ VAR(mapjoints, 0, 1, 1);
 
 void makesticky()
 {
-    loopv(selected[SEL_SPHERE]) spheres[selected[SEL_SPHERE][i]].sticky = !spheres[selected[SEL_SPHERE][i]].sticky;
+    if(dragging < 0) beginundo();
+    loopv(selected[SEL_SPHERE])
+    {
+        int idx = selected[SEL_SPHERE][i];
+        undosphere(idx);
+        spheres[idx].sticky = !spheres[idx].sticky;
+        journalf("k %d %d\n", idx, spheres[idx].sticky ? 1 : 0);
+    }
     selected[SEL_SPHERE].setsize(0);
-    if(dragging>=0) spheres[dragging].sticky = !spheres[dragging].sticky;
+    if(dragging>=0)
+    {
+        spheres[dragging].sticky = !spheres[dragging].sticky;
+        journalf("k %d %d\n", dragging, spheres[dragging].sticky ? 1 : 0);
+    }
+    else endundo();
 }
 COMMAND(makesticky, "");
 
@@ -1512,8 +3588,10 @@ void constraindist()
 {
     if(selected[SEL_SPHERE].size()>=2)
     {
+        beginundo();
         loopi(selected[SEL_SPHERE].size()-1)
-            constraints.add(new DistConstraint(selected[SEL_SPHERE][i], selected[SEL_SPHERE][i+1]));
+            journalconstraint(constraints.add(new DistConstraint(selected[SEL_SPHERE][i], selected[SEL_SPHERE][i+1])));
+        endundo();
     }
     selected[SEL_SPHERE].setsize(0);
 }
@@ -1521,30 +3599,42 @@ COMMAND(constraindist, "");
 
 void updatedist()
 {
+    beginundo();
     loopv(constraints)
     {
         DistConstraint *d = dynamic_cast<DistConstraint *>(constraints[i]);
-        if(d) d->update();
+        if(d) { undoconstraint(i); d->update(); }
     }
+    endundo();
+    requestsnapshot();
 }
 COMMAND(updatedist, "");
 
 void updateconstraints()
 {
-    loopv(constraints) constraints[i]->update();
+    beginundo();
+    loopv(constraints) { undoconstraint(i); constraints[i]->update(); }
+    endundo();
+    requestsnapshot();
 }
 COMMAND(updateconstraints, "");
 
 void addtri()
 {
     if(selected[SEL_SPHERE].size()>=3)
+    {
+        beginundo();
         tris.add(Tri(selected[SEL_SPHERE][0], selected[SEL_SPHERE][1], selected[SEL_SPHERE][2]));
+        endundo();
+        journalf("t %d %d %d\n", selected[SEL_SPHERE][0], selected[SEL_SPHERE][1], selected[SEL_SPHERE][2]);
+    }
     selected[SEL_SPHERE].setsize(0);
 }
 COMMAND(addtri, "");
 
 void delconstraints()
 {
+    beginundo();
     loopv(constraints)
     {
         Constraint *c = constraints[i];
@@ -1554,9 +3644,17 @@ void delconstraints()
             if(c->uses(k, selected[k][j])) numused++;
             else goto nextconstraint;
         }
-        if(numused>=2) constraints.remove(i--);
+        if(numused>=2)
+        {
+            int a, b;
+            constraintlinks(c, a, b);
+            journalf("y %d %d %d %d\n", i, c->type(), a, b);
+            undoremoveconstraint(i);
+            delete constraints.remove(i--);
+        }
     nextconstraint:;
     }
+    endundo();
     loopk(3) selected[k].setsize(0);
 }
 COMMAND(delconstraints, "");
@@ -1583,13 +3681,18 @@ void bindjoint()
 {
     if(selected[SEL_SPHERE].size()>0 && selected[SEL_TRI].size()>0 && selected[SEL_JOINT].size()>0)
     {
+        beginundo();
+        undojoint(selected[SEL_JOINT][0]);
         Joint &j = joints[selected[SEL_JOINT][0]];
         j.tri = selected[SEL_TRI][0];
+        jointmapdirty = true;
         loopk(3) j.spheres[k] = -1;
         Vec3 pos(0, 0, 0);
         loopi(min(selected[SEL_SPHERE].size(), 3)) { j.spheres[i] = selected[SEL_SPHERE][i]; pos += spheres[selected[SEL_SPHERE][i]].pos; }
         pos /= min(selected[SEL_SPHERE].size(), 3);
         j.tridiff = Matrix3x4(tris[j.tri].orient, tris[j.tri].orient.transform(-pos));
+        endundo();
+        journaljoint(selected[SEL_JOINT][0]);
     }
     selected[SEL_SPHERE].setsize(0);
     selected[SEL_TRI].setsize(0);
@@ -1599,21 +3702,30 @@ COMMAND(bindjoint, "");
 
 void fixmodeloffset()
 {
-    loopv(spheres) spheres[i].pos.z += moffset;
+    beginundo();
+    loopv(spheres) { undosphere(i); spheres[i].pos.z += moffset; }
     loopv(joints)
     {
+        undojoint(i);
         Joint &j = joints[i];
         j.tridiff.a.w -= j.tridiff.a.z*moffset;
         j.tridiff.b.w -= j.tridiff.b.z*moffset;
         j.tridiff.c.w -= j.tridiff.c.z*moffset;
     }
+    jointmapdirty = true;
+    endundo();
+    requestsnapshot();
 }
 COMMAND(fixmodeloffset, "");
 
 void constrainrot(int *angle)
 {
     if(selected[SEL_TRI].size()>=2)
-        constraints.add(new RotConstraint(selected[SEL_TRI][0], selected[SEL_TRI][1], *angle <= 0 ? 60 : *angle));
+    {
+        beginundo();
+        journalconstraint(constraints.add(new RotConstraint(selected[SEL_TRI][0], selected[SEL_TRI][1], *angle <= 0 ? 60 : *angle)));
+        endundo();
+    }
     selected[SEL_TRI].setsize(0);
 }
 COMMAND(constrainrot, "i");
@@ -1631,6 +3743,70 @@ void printjointmap()
 }
 COMMAND(printjointmap, "");
 
+// orient = Matrix3x4(transpose(rot), pos) * tridiff
+static inline void calcjointorient(const Matrix3x3 &rot, const Vec3 &pos, const Matrix3x4 &tridiff, Matrix3x4 &orient)
+{
+#ifdef __SSE__
+    __m128 ta = _mm_loadu_ps(tridiff.a.v), tb = _mm_loadu_ps(tridiff.b.v), tc = _mm_loadu_ps(tridiff.c.v);
+    #define ORIENTROW(row, col) \
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(rot.a.col), ta), _mm_mul_ps(_mm_set1_ps(rot.b.col), tb)), \
+                   _mm_add_ps(_mm_mul_ps(_mm_set1_ps(rot.c.col), tc), _mm_set_ps(pos.col, 0, 0, 0)))
+    _mm_storeu_ps(orient.a.v, ORIENTROW(a, x));
+    _mm_storeu_ps(orient.b.v, ORIENTROW(b, y));
+    _mm_storeu_ps(orient.c.v, ORIENTROW(c, z));
+    #undef ORIENTROW
+#else
+    Matrix3x3 inv;
+    inv.transpose(rot);
+    orient = Matrix3x4(inv, pos) * tridiff;
+#endif
+}
+
+Vector<int> posebatch;
+Vector<Vec3> posecenters;
+Vector<Matrix3x4> poseorients;
+
+void mapjointposes()
+{
+    PROFILE(PROF_MAPJOINTS);
+    if(jointmapdirty) updatejointmap();
+    posebatch.setsize(0);
+    posecenters.setsize(0);
+    loopv(boundjoints)
+    {
+        Joint &j = joints[boundjoints[i]];
+        Vec3 pos(0, 0, 0);
+        int total = 0;
+        loopk(3) if(spheres.inrange(j.spheres[k])) { pos += spheres[j.spheres[k]].pos; total++; }
+        pos /= total;
+        j.moved = true;
+        if(j.poseversion == tris[j.tri].version && j.posecenter == pos) continue;
+        posebatch.add(boundjoints[i]);
+        posecenters.add(pos);
+    }
+    poseorients.setsize(0);
+    loopv(posebatch)
+    {
+        const Joint &j = joints[posebatch[i]];
+        calcjointorient(tris[j.tri].orient, posecenters[i], j.tridiff, poseorients.add());
+    }
+    loopv(posebatch)
+    {
+        Joint &j = joints[posebatch[i]];
+        j.setorient(poseorients[i]);
+        j.poseversion = tris[j.tri].version;
+        j.posecenter = posecenters[i];
+    }
+    // ancestors come first in the order, so their pose is already current
+    loopv(unboundjoints)
+    {
+        int idx = unboundjoints[i], anc = jointanc[idx];
+        Joint &j = joints[idx];
+        j.moved = anc >= 0;
+        if(j.moved) j.setorient(joints[anc].orient);
+    }
+}
+
 void unmapjoints()
 {
     Vector<Vec3> unmap;
@@ -1647,13 +3823,23 @@ void unmapjoints()
             counts[sphere]++;
         }
     }
-    loopv(spheres) if(counts[i]) spheres[i].oldpos = spheres[i].pos = unmap[i] / counts[i];
+    beginundo();
+    loopv(spheres) if(counts[i]) { undosphere(i); spheres[i].oldpos = spheres[i].pos = unmap[i] / counts[i]; }
+    endundo();
+    requestsnapshot();
 }
 COMMAND(unmapjoints, "");
 
 void movespheres(const Vec3 &pos)
 {
-    loopv(selected[SEL_SPHERE]) spheres[selected[SEL_SPHERE][i]].pos += pos;
+    beginundo();
+    loopv(selected[SEL_SPHERE])
+    {
+        undosphere(selected[SEL_SPHERE][i]);
+        spheres[selected[SEL_SPHERE][i]].pos += pos;
+        journalpos(selected[SEL_SPHERE][i]);
+    }
+    endundo();
     selected[SEL_SPHERE].setsize(0);
 }
 ICOMMAND(movespheres, "fff", (float *x, float *y, float *z), movespheres(Vec3(*x, *y, *z)));
@@ -1674,7 +3860,9 @@ COMMAND(getpos, "");
 void savepos(int *n)
 {
     if(*n < 0 || *n > 2) return;
-    loopv(spheres) spheres[i].saved[*n] = spheres[i].pos;
+    savedpos[*n].setsize(0);
+    loopv(spheres) savedpos[*n].add(spheres[i].pos);
+    requestsnapshot();
     conoutf("saved positions %d", *n);
 }
 COMMAND(savepos, "i");
@@ -1682,7 +3870,10 @@ COMMAND(savepos, "i");
 void loadpos(int *n)
 {
     if(*n < 0 || *n > 2) return;
-    loopv(spheres) spheres[i].oldpos = spheres[i].pos = spheres[i].saved[*n];
+    beginundo();
+    loopv(spheres) { undosphere(i); spheres[i].oldpos = spheres[i].pos = getsavedpos(*n, i); }
+    endundo();
+    requestsnapshot();
     conoutf("loaded positions %d", *n);
 }
 COMMAND(loadpos, "i");
@@ -1698,9 +3889,9 @@ void writecfg(const char *name)
         Vec3 pos = spheres[i].pos;
         pos.z -= moffset;
         pos /= mscale;
-        fprintf(f, "rdvert %f %f %f", pos.x, pos.y, pos.z);
+        fprintf(f, "rdvert %s %s %s", floatstr(pos.x), floatstr(pos.y), floatstr(pos.z));
         if(spheres[i].size > 1)
-            fprintf(f, " %f", spheres[i].size);
+            fprintf(f, " %s", floatstr(spheres[i].size));
         fprintf(f, "\n");
         if(spheres[i].eye) fprintf(f, "rdeye %d\n", i);
     }
@@ -1723,6 +3914,7 @@ FVAR(sensitivity, 1e-3f, 3, 1000);
 
 void mousemove(int x, int y)
 {
+    requestredraw();
     if(cursormode)
     {
         float sens = cursorsensitivity/500.0f;
@@ -1744,6 +3936,7 @@ void checkinput()
     SDL_Event event;
     while(SDL_PollEvent(&event))
     {
+        if(event.type != SDL_MOUSEMOTION) requestredraw();
         switch(event.type)
         {
         case SDL_QUIT:
@@ -1828,12 +4021,132 @@ void gensphere(int slices, int stacks)
     }
 }
 
-void rendersphere()
+struct SphereInstance
+{
+    Vec3 pos;
+    float scale;
+    Vec3 color;
+};
+Vector<SphereInstance> sphereinstances;
+Vector<Vec3> spherebatchverts, spherebatchcolors;
+Vector<uint> spherebatchidxs;
+GLuint spherevbo = 0, sphereibo = 0, sphereinstvbo = 0, sphereprog = 0;
+GLint sphereposattrib = -1, spherecolorattrib = -1;
+int sphereprogstate = 0;
+
+VAR(instancespheres, 0, 1, 1);
+
+void addsphereinstance(const Vec3 &pos, float scale, const Vec3 &color)
+{
+    SphereInstance &s = sphereinstances.add();
+    s.pos = pos;
+    s.scale = scale;
+    s.color = color;
+}
+
+static const char *spherevs =
+    "#version 120\n"
+    "attribute vec4 instpos;\n"
+    "attribute vec3 instcolor;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(gl_Vertex.xyz*instpos.w + instpos.xyz, 1.0);\n"
+    "    gl_FrontColor = vec4(instcolor, 1.0);\n"
+    "}\n";
+
+bool setupsphereprog()
+{
+    if(sphereprogstate) return sphereprogstate > 0;
+    sphereprogstate = -1;
+    GLuint vs = glCreateShader_(GL_VERTEX_SHADER);
+    const GLchar *src = spherevs;
+    glShaderSource_(vs, 1, &src, NULL);
+    glCompileShader_(vs);
+    GLint success = 0;
+    glGetShaderiv_(vs, GL_COMPILE_STATUS, &success);
+    if(!success) { glDeleteShader_(vs); conoutf(CON_WARN, "failed compiling sphere shader, using batched fallback"); return false; }
+    sphereprog = glCreateProgram_();
+    glAttachShader_(sphereprog, vs);
+    glLinkProgram_(sphereprog);
+    glDeleteShader_(vs);
+    glGetProgramiv_(sphereprog, GL_LINK_STATUS, &success);
+    sphereposattrib = glGetAttribLocation_(sphereprog, "instpos");
+    spherecolorattrib = glGetAttribLocation_(sphereprog, "instcolor");
+    if(!success || sphereposattrib < 0 || spherecolorattrib < 0)
+    {
+        glDeleteProgram_(sphereprog); // also frees the attached shader flagged for deletion above
+        sphereprog = 0;
+        conoutf(CON_WARN, "failed linking sphere shader, using batched fallback");
+        return false;
+    }
+
+    glGenBuffers_(1, &spherevbo);
+    glBindBuffer_(GL_ARRAY_BUFFER_ARB, spherevbo);
+    glBufferData_(GL_ARRAY_BUFFER_ARB, sphereverts.size()*sizeof(Vec3), sphereverts.getbuf(), GL_STATIC_DRAW_ARB);
+    glGenBuffers_(1, &sphereibo);
+    glBindBuffer_(GL_ELEMENT_ARRAY_BUFFER_ARB, sphereibo);
+    glBufferData_(GL_ELEMENT_ARRAY_BUFFER_ARB, sphereidxs.size()*sizeof(ushort), sphereidxs.getbuf(), GL_STATIC_DRAW_ARB);
+    glGenBuffers_(1, &sphereinstvbo);
+    glBindBuffer_(GL_ARRAY_BUFFER_ARB, 0);
+    glBindBuffer_(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+    sphereprogstate = 1;
+    return true;
+}
+
+void flushspheres()
 {
+    if(sphereinstances.empty()) return;
+    // the color array leaves the current color undefined, so keep it for the draws that follow
+    glPushAttrib(GL_CURRENT_BIT);
     glEnableClientState(GL_VERTEX_ARRAY);
-    glVertexPointer(3, GL_FLOAT, sizeof(Vec3), sphereverts.getbuf());
-    glDrawElements(GL_TRIANGLES, sphereidxs.size(), GL_UNSIGNED_SHORT, sphereidxs.getbuf());
+    if(hasinstancing && instancespheres && setupsphereprog())
+    {
+        glBindBuffer_(GL_ARRAY_BUFFER_ARB, spherevbo);
+        glVertexPointer(3, GL_FLOAT, sizeof(Vec3), NULL);
+        glBindBuffer_(GL_ARRAY_BUFFER_ARB, sphereinstvbo);
+        glBufferData_(GL_ARRAY_BUFFER_ARB, sphereinstances.size()*sizeof(SphereInstance), sphereinstances.getbuf(), GL_STREAM_DRAW_ARB);
+        glEnableVertexAttribArray_(sphereposattrib);
+        glEnableVertexAttribArray_(spherecolorattrib);
+        glVertexAttribPointer_(sphereposattrib, 4, GL_FLOAT, GL_FALSE, sizeof(SphereInstance), (const GLvoid *)0);
+        glVertexAttribPointer_(spherecolorattrib, 3, GL_FLOAT, GL_FALSE, sizeof(SphereInstance), (const GLvoid *)(4*sizeof(float)));
+        glVertexAttribDivisor_(sphereposattrib, 1);
+        glVertexAttribDivisor_(spherecolorattrib, 1);
+        glBindBuffer_(GL_ELEMENT_ARRAY_BUFFER_ARB, sphereibo);
+        glUseProgram_(sphereprog);
+        glDrawElementsInstanced_(GL_TRIANGLES, sphereidxs.size(), GL_UNSIGNED_SHORT, NULL, sphereinstances.size());
+        glUseProgram_(0);
+        glVertexAttribDivisor_(sphereposattrib, 0);
+        glVertexAttribDivisor_(spherecolorattrib, 0);
+        glDisableVertexAttribArray_(sphereposattrib);
+        glDisableVertexAttribArray_(spherecolorattrib);
+        glBindBuffer_(GL_ARRAY_BUFFER_ARB, 0);
+        glBindBuffer_(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+    }
+    else
+    {
+        spherebatchverts.setsize(0);
+        spherebatchcolors.setsize(0);
+        loopv(sphereinstances)
+        {
+            const SphereInstance &s = sphereinstances[i];
+            loopvj(sphereverts)
+            {
+                spherebatchverts.add(s.pos + sphereverts[j]*s.scale);
+                spherebatchcolors.add(s.color);
+            }
+        }
+        int numidxs = sphereinstances.size()*sphereidxs.size();
+        for(int base = spherebatchidxs.size()/max(sphereidxs.size(), 1)*sphereverts.size(); spherebatchidxs.size() < numidxs; base += sphereverts.size())
+            loopv(sphereidxs) spherebatchidxs.add(base + sphereidxs[i]);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(Vec3), spherebatchverts.getbuf());
+        glColorPointer(3, GL_FLOAT, sizeof(Vec3), spherebatchcolors.getbuf());
+        glDrawElements(GL_TRIANGLES, numidxs, GL_UNSIGNED_INT, spherebatchidxs.getbuf());
+        glDisableClientState(GL_COLOR_ARRAY);
+    }
     glDisableClientState(GL_VERTEX_ARRAY);
+    glPopAttrib();
+    sphereinstances.setsize(0);
 }
 
 bool movecam(const Vec3 &vel)
@@ -1847,6 +4160,145 @@ FVAR(airfric, 0, 0.99f, 1);
 FVAR(groundfric, 0, 0.7f, 1);
 FVAR(velcut, 0, 1e-5f, 1);
 
+VAR(selfcollide, 0, 0, 1);
+FVAR(selfcollidemargin, 0, 0.25f, 10);
+
+bool spherepinned(int idx)
+{
+    return spheres[idx].sticky || idx==dragging || (dragging>=0 && selected[SEL_SPHERE].find(idx)>=0);
+}
+
+// self-collision broadphase: spheres are bucketed by center into a uniform hash grid once per step,
+// and pairs that are close enough to touch during the step are resolved on every constraint iteration
+Vector<int> collidecells, collidenext, collidecoords, collidelinkstart, collidelinks, collidepairs;
+
+static inline uint collidehash(int x, int y, int z)
+{
+    return uint(x)*73856093U ^ uint(y)*19349663U ^ uint(z)*83492791U;
+}
+
+static inline void addcollidelink(int a, int b)
+{
+    collidelinks[--collidelinkstart[a]] = b;
+    collidelinks[--collidelinkstart[b]] = a;
+}
+
+// spheres joined by a distance constraint or a shared tri are expected to overlap
+void buildcollidelinks()
+{
+    collidelinkstart.setsize(0);
+    loopi(spheres.size()+1) collidelinkstart.add(0);
+    loopv(constraints) if(constraints[i]->type()==CONSTRAINT_DIST)
+    {
+        DistConstraint *d = (DistConstraint *)constraints[i];
+        collidelinkstart[d->sphere1]++;
+        collidelinkstart[d->sphere2]++;
+    }
+    loopv(tris)
+    {
+        collidelinkstart[tris[i].sphere1] += 2;
+        collidelinkstart[tris[i].sphere2] += 2;
+        collidelinkstart[tris[i].sphere3] += 2;
+    }
+    loopv(spheres) collidelinkstart[i+1] += collidelinkstart[i];
+    collidelinks.setsize(0);
+    loopi(collidelinkstart.last()) collidelinks.add(-1);
+    loopv(constraints) if(constraints[i]->type()==CONSTRAINT_DIST)
+    {
+        DistConstraint *d = (DistConstraint *)constraints[i];
+        addcollidelink(d->sphere1, d->sphere2);
+    }
+    loopv(tris)
+    {
+        const Tri &t = tris[i];
+        addcollidelink(t.sphere1, t.sphere2);
+        addcollidelink(t.sphere2, t.sphere3);
+        addcollidelink(t.sphere3, t.sphere1);
+    }
+}
+
+bool collidelinked(int a, int b)
+{
+    for(int i = collidelinkstart[a], end = collidelinkstart[a+1]; i < end; i++) if(collidelinks[i]==b) return true;
+    return false;
+}
+
+void findcollisions()
+{
+    collidepairs.setsize(0);
+    if(spheres.size() < 2) return;
+    float maxsize = 0;
+    loopv(spheres) maxsize = max(maxsize, spheres[i].size);
+    float margin = selfcollidemargin*maxsize*spherescale, cellsize = 2*maxsize*spherescale + margin;
+    if(cellsize <= 0) return;
+    float invcell = 1/cellsize;
+    int numcells = 64;
+    while(numcells < 2*spheres.size()) numcells <<= 1;
+    uint mask = numcells-1;
+    collidecells.setsize(0);
+    loopi(numcells) collidecells.add(-1);
+    collidenext.setsize(0);
+    collidecoords.setsize(0);
+    loopv(spheres)
+    {
+        const Vec3 &pos = spheres[i].pos;
+        int x = int(floor(pos.x*invcell)), y = int(floor(pos.y*invcell)), z = int(floor(pos.z*invcell));
+        collidecoords.add(x);
+        collidecoords.add(y);
+        collidecoords.add(z);
+        uint h = collidehash(x, y, z)&mask;
+        collidenext.add(collidecells[h]);
+        collidecells[h] = i;
+    }
+    buildcollidelinks();
+    loopv(spheres)
+    {
+        const Sphere &s = spheres[i];
+        const int *c = &collidecoords[3*i];
+        for(int dz = -1; dz <= 1; dz++) for(int dy = -1; dy <= 1; dy++) for(int dx = -1; dx <= 1; dx++)
+        {
+            int x = c[0]+dx, y = c[1]+dy, z = c[2]+dz;
+            for(int j = collidecells[collidehash(x, y, z)&mask]; j >= 0; j = collidenext[j])
+            {
+                // buckets can alias, so only take spheres from the exact cell to avoid duplicate pairs
+                if(j <= i || collidecoords[3*j]!=x || collidecoords[3*j+1]!=y || collidecoords[3*j+2]!=z) continue;
+                const Sphere &o = spheres[j];
+                float r = (s.size + o.size)*spherescale + margin;
+                if((o.pos - s.pos).squaredlen() >= r*r || collidelinked(i, j)) continue;
+                collidepairs.add(i);
+                collidepairs.add(j);
+            }
+        }
+    }
+}
+
+void resolvecollisions()
+{
+    for(int i = 0; i < collidepairs.size(); i += 2)
+    {
+        int a = collidepairs[i], b = collidepairs[i+1];
+        bool pinneda = spherepinned(a), pinnedb = spherepinned(b);
+        if(pinneda && pinnedb) continue;
+        Sphere &s1 = spheres[a], &s2 = spheres[b];
+        float r = (s1.size + s2.size)*spherescale;
+        Vec3 dir = s2.pos - s1.pos;
+        float dist = dir.squaredlen();
+        if(dist >= r*r) continue;
+        dist = sqrtf(dist);
+        if(dist > 1e-6f) dir /= dist;
+        else dir = Vec3(0, 0, 1);
+        Vec3 push = dir*(r - dist);
+        if(pinneda) s2.pos += push;
+        else if(pinnedb) s1.pos -= push;
+        else
+        {
+            push *= 0.5f;
+            s1.pos -= push;
+            s2.pos += push;
+        }
+    }
+}
+
 void movesphere(Sphere &s, int idx, float ts)
 {
     Vec3 curpos = s.pos;
@@ -1859,11 +4311,16 @@ void movesphere(Sphere &s, int idx, float ts)
     }
     s.collided = false;
     if(s.pos.z - s.size*spherescale < 0) { s.collided = true; s.pos.z = s.size*spherescale; }
+    if(collision.collide(s.pos, s.size*spherescale)) s.collided = true;
+    if(s.collided) solverstats.contacts++; // ground plane or collision mesh
+    if((s.pos - curpos).squaredlen() > velcut) requestredraw();
     s.oldpos = curpos;
 }
 
 void constrainspheres()
 {
+    ullong start = proftime();
+    solverstats.passes++;
     loopv(tris) tris[i].calcorient();
     loopv(spheres)
     {
@@ -1871,27 +4328,61 @@ void constrainspheres()
         s.newpos = Vec3(0, 0, 0);
         s.avg = 0;
     }
+    RotConstraint::selectmode();
     loopv(constraints) constraints[i]->apply();
     loopv(spheres)
     {
         Sphere &s = spheres[i];
-        if(s.avg && !s.sticky && i!=dragging && (dragging<0 || selected[SEL_SPHERE].find(i)<0)) s.pos = s.newpos / s.avg;
+        if(s.avg && !spherepinned(i))
+        {
+            Vec3 pos = s.newpos / s.avg;
+            float dist = (pos - s.pos).squaredlen();
+            if(dist > velcut) requestredraw();
+            solverstats.addcorrection(sqrtf(dist));
+            s.pos = pos;
+        }
     }
+    if(selfcollide) resolvecollisions();
+    solverstats.passtime += proftime() - start;
 }
 
 void animatespheres(float ts)
 {
+    PROFILE(PROF_ANIMATE);
+    solverstats.reset();
     loopv(spheres)
     {
         Sphere &s = spheres[i];
         movesphere(s, i, ts);
     }
+    if(selfcollide) findcollisions();
     loopk(iterconstraints+1) constrainspheres();
     if(stepping) { animmode = false; stepping = false; }
 }
 
+ICOMMAND(getsolverpasses, "", (), intret(solverstats.passes));
+ICOMMAND(getsolverapplied, "", (), floatret(solverstats.passes ? float(solverstats.applied)/solverstats.passes : 0.0f));
+ICOMMAND(getsolveractiverots, "", (), floatret(solverstats.passes ? float(solverstats.activerots)/solverstats.passes : 0.0f));
+ICOMMAND(getsolvermaxcorrection, "", (), floatret(solverstats.maxcorrection));
+ICOMMAND(getsolveravgcorrection, "", (), floatret(solverstats.corrections ? solverstats.totalcorrection/solverstats.corrections : 0.0f));
+ICOMMAND(getsolvercontacts, "", (), intret(solverstats.contacts));
+ICOMMAND(getsolverpasstime, "", (), floatret(solverstats.passes ? solverstats.passtime/(1e6*solverstats.passes) : 0.0f));
+
+void printsolverstats()
+{
+    const SolverStats &s = solverstats;
+    if(!s.passes) { conoutf("no solver step recorded"); return; }
+    int passes = s.passes;
+    conoutf("%d passes, %.1f constraints and %.1f active rotation limits per pass",
+        s.passes, float(s.applied)/passes, float(s.activerots)/passes);
+    conoutf("correction max %f avg %f, %d contacts, %.3f ms per pass",
+        s.maxcorrection, s.corrections ? s.totalcorrection/s.corrections : 0.0f, s.contacts, s.passtime/(1e6*passes));
+}
+COMMAND(printsolverstats, "");
+
 void drawconsole()
 {
+    PROFILE(PROF_CONSOLE);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
 
@@ -1911,6 +4402,10 @@ void drawconsole()
     int abovehud = h*3 - FONTH/2;
     rendercommand(FONTH/2, abovehud - FONTH*3/2, w*3-FONTH);
 
+    renderprofile(w*3 - FONTW*44, FONTH/2);
+
+    if(modelload) draw_textf("loading %s %d%%", FONTH/2, abovehud - FONTH*5/2, modelload->name, modelload->md.progress);
+
     glDisable(GL_TEXTURE_2D);
     glDisable(GL_BLEND);
     glEnable(GL_DEPTH_TEST);
@@ -1940,14 +4435,273 @@ void disabledepthoffset()
     glMatrixMode(GL_MODELVIEW);
 }
 
+// frames are only drawn when something may have changed since the last one
+bool needredraw = true;
+
+void requestredraw()
+{
+    needredraw = true;
+}
+
+VAR(idlewait, 0, 1, 1);
+
+bool sceneactive()
+{
+    return animmode || dragging >= 0 || forward || backward || left || right || up || down || modelload;
+}
+
+Uint32 idletimer(Uint32 interval, void *param)
+{
+    SDL_Event event;
+    event.type = SDL_USEREVENT;
+    SDL_PushEvent(&event);
+    return 0;
+}
+
+// blocks until the next input event, or until a timed change is due if timeout is not negative
+void waitidle(int timeout)
+{
+    SDL_TimerID timer = timeout >= 0 ? SDL_AddTimer(max(timeout, 1), idletimer, NULL) : NULL;
+    SDL_WaitEvent(NULL);
+    if(timer) SDL_RemoveTimer(timer);
+}
+
+// headless batch pipeline: fit the template rig to each model, settle it and write its cfg
+
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+
+static bool batchmodelfile(const char *name)
+{
+    const char *type = strrchr(name, '.');
+    return type && (!strcasecmp(type, ".md5mesh") || !strcasecmp(type, ".iqm"));
+}
+
+static int batchcmp(char **x, char **y) { return strcmp(*x, *y); }
+
+static void addbatchmodels(const char *name, Vector<char *> &models)
+{
+    int first = models.size();
+#ifdef WIN32
+    defprintstring(pattern)("%s\\*", name);
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile(pattern, &data);
+    if(h == INVALID_HANDLE_VALUE) { models.add(newstring(name)); return; }
+    do if(batchmodelfile(data.cFileName))
+    {
+        defprintstring(file)("%s\\%s", name, data.cFileName);
+        models.add(newstring(file));
+    }
+    while(FindNextFile(h, &data));
+    FindClose(h);
+#else
+    DIR *d = opendir(name);
+    if(!d) { models.add(newstring(name)); return; }
+    for(dirent *e; (e = readdir(d));) if(batchmodelfile(e->d_name))
+    {
+        defprintstring(file)("%s/%s", name, e->d_name);
+        models.add(newstring(file));
+    }
+    closedir(d);
+#endif
+    models.sort(batchcmp, first, models.size() - first);
+}
+
+// <outdir>/<model>.cfg, or next to the model if no output directory is given
+static void batchoutput(const char *model, const char *outdir, char *out)
+{
+    const char *base = model, *ext = NULL;
+    for(const char *s = model; *s; s++)
+    {
+        if(*s=='/' || *s=='\\') { base = s+1; ext = NULL; }
+        else if(*s=='.') ext = s;
+    }
+    int len = ext ? ext - base : strlen(base);
+    if(outdir) printstring(out)("%s/%.*s.cfg", outdir, len, base);
+    else printstring(out)("%.*s.cfg", int(base - model) + len, model);
+}
+
+// moves the template's spheres along with its joints onto the loaded model and rebinds joints by name
+static bool fitrig(const Vector<Joint> &tjoints)
+{
+    Vector<int> match;
+    int matched = 0;
+    loopv(tjoints)
+    {
+        match.add(-1);
+        loopvj(joints) if(!strcmp(joints[j].name, tjoints[i].name)) { match[i] = j; matched++; break; }
+    }
+    if(!matched) { conoutf(CON_ERROR, "no joints in common with the template"); return false; }
+
+    loopv(spheres)
+    {
+        Sphere &s = spheres[i];
+        int anchor = -1;
+        loopvj(tjoints)
+        {
+            const Joint &tj = tjoints[j];
+            if(match[j] >= 0 && tj.tri >= 0 && (tj.spheres[0]==i || tj.spheres[1]==i || tj.spheres[2]==i)) { anchor = j; break; }
+        }
+        if(anchor < 0)
+        {
+            float best = 1e16f;
+            loopvj(tjoints) if(match[j] >= 0)
+            {
+                float dist = (tjoints[j].pos - s.pos).squaredlen();
+                if(dist < best) { best = dist; anchor = j; }
+            }
+        }
+        s.oldpos = s.pos += joints[match[anchor]].pos - tjoints[anchor].pos;
+    }
+    // constraints keep the template's rest lengths and angles, which the settle then pulls the rig back to
+    loopv(tris) tris[i].calcorient();
+    return true;
+}
+
+static void bindrig(const Vector<Joint> &tjoints)
+{
+    loopv(tjoints)
+    {
+        const Joint &tj = tjoints[i];
+        if(tj.tri < 0 || !tris.inrange(tj.tri)) continue;
+        loopvj(joints)
+        {
+            Joint &dj = joints[j];
+            if(strcmp(dj.name, tj.name)) continue;
+            dj.tri = tj.tri;
+            Vec3 pos(0, 0, 0);
+            int num = 0;
+            loopk(3)
+            {
+                dj.spheres[k] = spheres.inrange(tj.spheres[k]) ? tj.spheres[k] : -1;
+                if(dj.spheres[k] >= 0) { pos += spheres[dj.spheres[k]].pos; num++; }
+            }
+            if(num) pos /= num;
+            dj.tridiff = Matrix3x4(tris[dj.tri].orient, tris[dj.tri].orient.transform(-pos));
+            break;
+        }
+    }
+    jointmapdirty = true;
+}
+
+// expects the template scene to be loaded
+static bool batchmodel(const char *model, const char *out, int steps)
+{
+    ullong start = proftime();
+    Vector<Joint> tjoints = joints;
+    if(!loadmodel(model, mscale)) return false;
+    ullong loaded = proftime();
+    if(!fitrig(tjoints)) return false;
+    ullong fitted = proftime();
+    animmode = false;
+    loopi(steps) animatespheres(0.01f);
+    ullong settled = proftime();
+    bindrig(tjoints);
+    writecfg(out);
+    ullong written = proftime();
+    printf("%s: load %.1f ms, fit %.1f ms, settle %.1f ms, write %.1f ms, total %.1f ms\n", model,
+        (loaded - start)/1e6, (fitted - loaded)/1e6, (settled - fitted)/1e6, (written - settled)/1e6, (written - start)/1e6);
+    fflush(stdout);
+    return true;
+}
+
+#ifndef WIN32
+struct BatchJob
+{
+    pid_t pid;
+    int model;
+};
+#endif
+
+// ragdoll -b<template> [-c<cfg>] [-s<steps>] [-j<jobs>] [-o<outdir>] <model or directory>...
+int batchmain(int argc, char **argv)
+{
+    const char *templ = NULL, *cfg = NULL, *outdir = NULL;
+    int steps = 100, numjobs = numcpus();
+    Vector<char *> models;
+    for(int i = 1; i < argc; i++)
+    {
+        if(argv[i][0]=='-') switch(argv[i][1])
+        {
+            case 'b': templ = &argv[i][2]; break;
+            case 'c': cfg = &argv[i][2]; break;
+            case 's': steps = max(atoi(&argv[i][2]), 0); break;
+            case 'j': numjobs = clamp(atoi(&argv[i][2]), 1, 256); break;
+            case 'o': outdir = argv[i][2] ? &argv[i][2] : NULL; break;
+            default: conoutf(CON_ERROR, "unknown option: %s", argv[i]); break;
+        }
+        else addbatchmodels(argv[i], models);
+    }
+    if(!templ || !templ[0] || models.empty())
+    {
+        conoutf(CON_ERROR, "usage: ragdoll -b<template> [-c<cfg>] [-s<steps>] [-j<jobs>] [-o<outdir>] <model or directory>...");
+        return EXIT_FAILURE;
+    }
+    // models must be installed by the time batchmodel returns, including any the cfg loads
+    asyncload = 0;
+    if(cfg && !execfile(cfg)) conoutf(CON_ERROR, "could not read %s", cfg);
+    templ = newstring(path(templ, true));
+    if(!loadscenefile(templ)) { conoutf(CON_ERROR, "could not load template %s", templ); return EXIT_FAILURE; }
+
+    int failed = 0;
+    ullong start = proftime();
+#ifdef WIN32
+    loopv(models)
+    {
+        String out;
+        batchoutput(models[i], outdir, out);
+        if((i && !loadscenefile(templ)) || !batchmodel(models[i], out, steps)) { conoutf(CON_ERROR, "%s: failed", models[i]); failed++; }
+    }
+#else
+    // each model runs in a forked copy of the loaded template, so workers share nothing
+    Vector<BatchJob> jobs;
+    for(int next = 0; next < models.size() || jobs.size();)
+    {
+        if(next < models.size() && jobs.size() < numjobs)
+        {
+            String out;
+            batchoutput(models[next], outdir, out);
+            fflush(stdout);
+            pid_t pid = fork();
+            if(!pid)
+            {
+                bool ok = batchmodel(models[next], out, steps);
+                fflush(stdout);
+                _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+            if(pid < 0) { conoutf(CON_ERROR, "%s: could not start worker", models[next]); failed++; }
+            else { BatchJob &job = jobs.add(); job.pid = pid; job.model = next; }
+            next++;
+            continue;
+        }
+        int status = 0;
+        pid_t pid = wait(&status);
+        if(pid < 0) break;
+        loopv(jobs) if(jobs[i].pid == pid)
+        {
+            if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) { conoutf(CON_ERROR, "%s: failed", models[jobs[i].model]); failed++; }
+            jobs.remove(i);
+            break;
+        }
+    }
+#endif
+    conoutf("%d models, %d failed, %.1f ms using %d workers", models.size(), failed, (proftime() - start)/1e6, min(numjobs, models.size()));
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
+    loopi(argc) if(!strncmp(argv[i], "-b", 2)) return batchmain(argc, argv);
+
     if(SDL_Init(SDL_INIT_TIMER|SDL_INIT_VIDEO)<0) fatal("Unable to initialize SDL: %s", SDL_GetError());
+    initconsole();
 
     SDL_WM_SetCaption("ragdoll", NULL);
     SDL_ShowCursor(0);
 
     setupscreen(1024, 768);
+    gl_checkextensions();
 
     if(!execfile("config/keymap.cfg")) fatal("cannot find keymap");
     if(!execfile("config/font.cfg")) fatal("cannot find font definitions");
@@ -1958,6 +4712,7 @@ int main(int argc, char **argv)
     camera.origin = Vec3(0, 0, 5);
 
     execfile("config/autoexec.cfg");
+    initautosave();
 
     for(;;)
     {
@@ -1966,7 +4721,24 @@ int main(int argc, char **argv)
         if(curtime < 10) { SDL_Delay(10-curtime); continue; }
         lastmillis = millis;
 
+        profbeginframe();
+        profbegin(PROF_INPUT);
         checkinput();
+        profend(PROF_INPUT);
+        flushconsole();
+        checkmodelload();
+        checkautosave();
+
+        if(idlewait && !needredraw && !sceneactive())
+        {
+            profdiscardframe();
+            int timeout = consolewake(), autosave = autosavewake();
+            if(autosave >= 0 && (timeout < 0 || autosave < timeout)) timeout = autosave;
+            waitidle(timeout);
+            lastmillis = SDL_GetTicks();
+            continue;
+        }
+        needredraw = false;
 
         glDepthFunc(GL_LESS);
         glEnable(GL_DEPTH_TEST);
@@ -2003,40 +4775,13 @@ int main(int argc, char **argv)
             if(down) movecam(Vec3(radians(camera.yaw), radians(camera.pitch-90))*(curtime/1000.0f*movespeed));
 
             animatespheres(curtime/1000.0f);
-            if(mapjoints)
-            {
-                loopv(joints)
-                {
-                    Joint &j = joints[i];
-                    if(!tris.inrange(j.tri)) { j.moved = false; continue; }
-                    Vec3 pos(0, 0, 0);
-                    int total = 0;
-                    loopk(3) if(spheres.inrange(j.spheres[k])) { pos += spheres[j.spheres[k]].pos; total++; }
-                    if(!total) continue;
-                    pos /= total;
-                    Matrix3x3 inv;
-                    inv.transpose(tris[j.tri].orient);
-                    j.orient = Matrix3x4(inv, pos) * j.tridiff;
-                    j.moved = true;
-                }
-                loopv(joints)
-                {
-                    Joint &j = joints[i];
-                    if(j.moved) continue;
-                    for(int parent = j.parent; parent >= 0; parent = joints[parent].parent)
-                    {
-                        if(joints[parent].moved)
-                        {
-                            j.orient = joints[parent].orient;
-                            j.moved = true;
-                            break;
-                        }
-                    }
-                }
-            }
+            if(mapjoints) mapjointposes();
             else
             {
-                loopv(joints) joints[i].orient.identity();
+                Matrix3x4 id;
+                id.identity();
+                loopv(joints) joints[i].setorient(id);
+                jointmapdirty = true;
             }
         }
 
@@ -2049,6 +4794,7 @@ int main(int argc, char **argv)
         glVertex3f(fsz, fsz, 0);
         glEnd();
 
+        profbegin(PROF_SPHERES);
         enabledepthoffset();
         glDepthMask(GL_FALSE);
         glColor3f(0, 0, 0);
@@ -2062,6 +4808,7 @@ int main(int argc, char **argv)
         }
         glDepthMask(GL_TRUE);
         disabledepthoffset();
+        profend(PROF_SPHERES);
 
         glDisable(GL_CULL_FACE);
         bool selecting = false;
@@ -2079,21 +4826,19 @@ int main(int argc, char **argv)
         }
         glEnable(GL_CULL_FACE);
 
+        profbegin(PROF_JOINTS);
         if(showjoints) loopv(joints)
         {
             const Joint &j = joints[i];
             if(j.hide && showjoints <= 1) continue;
-            if(hovertype==SEL_JOINT && hoveridx==i) { glColor3f(1, 0, 0); selecting = true; }
-            else if(checkselected(i, SEL_JOINT)) glColor3f(0, 0.5f, 1);
-            else if(!j.used) glColor3f(j.tri>=0 ? 0 : 0.5f, 0.5f, 0.5f);
-            else glColor3f(j.tri>=0 ? 0.5f : 1, 1, 1);
-            glPushMatrix();
-            Vec3 pos = j.getpos();
-            glTranslatef(pos.x, pos.y, pos.z);
-            glScalef(0.1f, 0.1f, 0.1f);
-            rendersphere();
-            glPopMatrix();
+            Vec3 color;
+            if(hovertype==SEL_JOINT && hoveridx==i) { color = Vec3(1, 0, 0); selecting = true; }
+            else if(checkselected(i, SEL_JOINT)) color = Vec3(0, 0.5f, 1);
+            else if(!j.used) color = Vec3(j.tri>=0 ? 0 : 0.5f, 0.5f, 0.5f);
+            else color = Vec3(j.tri>=0 ? 0.5f : 1, 1, 1);
+            addsphereinstance(j.getpos(), 0.1f, color);
         }
+        flushspheres();
         if(showjoints && joints.size() > 1)
         {
             glDepthFunc(GL_ALWAYS);
@@ -2143,49 +4888,33 @@ int main(int argc, char **argv)
             glEnd();
             glDepthFunc(GL_LESS);
         }
-        if(showmverts && mtris.size() > 0)
-        {
-            loopv(mverts)
-            {
-                MVert &v = mverts[i];
-                v.curpos = Vec3(0, 0, 0);
-                loopj(4) if(v.weights[j]) v.curpos += joints[v.joints[j]].orient.transform(v.pos)*v.weights[j];
-            }
-
-            glColor3f(0.5f, 0.5f, 0.5f);
-            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-            glBegin(GL_TRIANGLES);
-            loopv(mtris)
-            {
-                MTri &t = mtris[i];
-                loopj(3) glVertex3fv(mverts[t.vert[j]].curpos.v);
-            }
-            glEnd();
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-        }
+        profend(PROF_JOINTS);
+        if(showmverts && mtris.size() > 0) rendermodel();
+        if(showcollision) collision.render();
+        profbegin(PROF_SPHERES);
         if(showspheres) loopv(spheres)
         {
             const Sphere &s = spheres[i];
+            Vec3 color;
             if(hovertype==SEL_SPHERE && hoveridx==i)
             {
-                glColor3f(1, 0, 0);
+                color = Vec3(1, 0, 0);
                 selecting = true;
             }
             else if(checkselected(i))
-                glColor3f(0, 0.5f, 1);
-            else if(s.sticky) glColor3f(1, 1, 0);
-            else glColor3f(0, 1, 0);
-            glPushMatrix();
-            glTranslatef(s.pos.x, s.pos.y, s.pos.z);
-            glScalef(s.size*spherescale, s.size*spherescale, s.size*spherescale);
-            rendersphere();
-            glPopMatrix();
+                color = Vec3(0, 0.5f, 1);
+            else if(s.sticky) color = Vec3(1, 1, 0);
+            else color = Vec3(0, 1, 0);
+            addsphereinstance(s.pos, s.size*spherescale, color);
         }
+        flushspheres();
+        profend(PROF_SPHERES);
 
-
+        profbegin(PROF_CONSTRAINTS);
         enabledepthoffset();
         if(showconstraints) loopv(constraints) constraints[i]->render();
         disabledepthoffset();
+        profend(PROF_CONSTRAINTS);
 
         if(showspheres && selected[SEL_SPHERE].size() > 1)
         {
@@ -2217,24 +4946,25 @@ int main(int argc, char **argv)
             glDepthFunc(GL_LESS);
         }
 
+        // billboard axes for world-space labels, matching a yaw/pitch rotation and a mirrored scale
+        float textsz = 0.15f/FONTH, textyaw = radians(camera.yaw-180), textpitch = radians(camera.pitch-90);
+        Vec3 textx = Vec3(cosf(textyaw), sinf(textyaw), 0)*-textsz,
+             texty = Vec3(-sinf(textyaw)*cosf(textpitch), cosf(textyaw)*cosf(textpitch), sinf(textpitch))*textsz;
+
         if(showspheres)
         {
             glDepthMask(GL_FALSE);
             glEnable(GL_BLEND);
             glEnable(GL_TEXTURE_2D);
+            begintextbatch();
             loopv(spheres) if(spheres[i].eye)
             {
                 Sphere &s = spheres[i];
-                glPushMatrix();
-                glTranslatef(s.pos.x, s.pos.y, s.pos.z - 0.2f);
-                glRotatef(camera.yaw-180, 0, 0, 1);
-                glRotatef(camera.pitch-90, 1, 0, 0);
-                float sz = 0.15f/FONTH;
-                glScalef(-sz, sz, -sz);
-                glTranslatef(-text_width("eye")/2, 0, 0);
+                settextxform(s.pos + Vec3(0, 0, -0.2f) + textx*float(-text_width("eye")/2), textx, texty);
                 draw_text("eye", 0, 0, 0, 0xFF, 0);
-                glPopMatrix();
             }
+            endtextbatch();
+            resettextxform();
             glDisable(GL_TEXTURE_2D);
             glDisable(GL_BLEND);
             glDepthMask(GL_TRUE);
@@ -2245,26 +4975,21 @@ int main(int argc, char **argv)
             glDepthMask(GL_FALSE);
             glEnable(GL_BLEND);
             glEnable(GL_TEXTURE_2D);
+            begintextbatch();
             loopv(joints)
             {
                 const Joint &j = joints[i];
                 if(j.hide && showjoints <= 1) continue;
-                glPushMatrix();
-                Vec3 pos = j.getpos();
-                glTranslatef(pos.x, pos.y, pos.z + 0.3f);
-                glRotatef(camera.yaw-180, 0, 0, 1);
-                glRotatef(camera.pitch-90, 1, 0, 0);
-                float sz = 0.15f/FONTH;
-                glScalef(-sz, sz, -sz);
-                glTranslatef(-text_width(j.name)/2, 0, 0);
+                settextxform(j.getpos() + Vec3(0, 0, 0.3f) + textx*float(-text_width(j.name)/2), textx, texty);
                 Vec3 color;
                 if(hovertype==SEL_JOINT && hoveridx==i) color = Vec3(1, 0, 0);
                 else if(checkselected(i, SEL_JOINT)) color = Vec3(0, 0.5f, 1);
                 else if(!j.used) color = Vec3(j.tri>=0 ? 0 : 0.5f, 0.5f, 0.5f);
                 else color = Vec3(j.tri>=0 ? 0.5f : 1, 1, 1);
                 draw_text(j.name, 0, 0, int(color.x*0xFF), int(color.y*0xFF), int(color.z*0xFF));
-                glPopMatrix();
             }
+            endtextbatch();
+            resettextxform();
             glDisable(GL_TEXTURE_2D);
             glDisable(GL_BLEND);
             glDepthMask(GL_TRUE);
@@ -2274,12 +4999,8 @@ int main(int argc, char **argv)
         {
             Vec3 inspos = campos + camdir*spawndist*camscale;
             float insz = 0.2f;
-            glColor3f(0, 0, 0.5f);
-            glPushMatrix();
-            glTranslatef(inspos.x, inspos.y, inspos.z);
-            glScalef(insz, insz, insz);
-            rendersphere();
-            glPopMatrix();
+            addsphereinstance(inspos, insz, Vec3(0, 0, 0.5f));
+            flushspheres();
 
             enabledepthoffset();
             glColor3f(0, 0, 0);
@@ -2335,6 +5056,7 @@ int main(int argc, char **argv)
         drawconsole();
 
         SDL_GL_SwapBuffers();
+        profendframe();
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,181 @@
+#include "engine.h"
+
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// frame profiler: scoped phase timers recorded into a ring of recent frames
+
+static const char * const profnames[PROF_NUM] =
+{
+    "frame", "input", "hover", "animate", "mapjoints", "skinning", "spheres", "joints", "constraints", "console"
+};
+
+ullong proftime()
+{
+#ifdef WIN32
+    static LARGE_INTEGER freq = { { 0, 0 } };
+    if(!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    return ullong(count.QuadPart / freq.QuadPart)*1000000000ULL + ullong(count.QuadPart % freq.QuadPart)*1000000000ULL/freq.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ullong(ts.tv_sec)*1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+struct profevent
+{
+    int phase, depth;
+    ullong start, end;
+};
+
+struct profframe
+{
+    enum { MAXEVENTS = 64 };
+
+    ullong start, end;
+    int numevents;
+    profevent events[MAXEVENTS];
+};
+
+profframe *profframes = NULL;
+int profcapacity = 0, profnewest = -1, proflen = 0, profdepth = 0;
+int profstack[profframe::MAXEVENTS];
+ullong profbase = 0;
+
+VARF(profiling, 0, 1, 1, profdepth = 0);
+VAR(showprofile, 0, 0, 1);
+VARF(profileframes, 2, 120, 10000,
+{
+    delete[] profframes;
+    profframes = NULL;
+    profcapacity = proflen = profdepth = 0;
+    profnewest = -1;
+});
+
+static profframe *curprofframe()
+{
+    return profnewest >= 0 && profdepth > 0 ? &profframes[profnewest] : NULL;
+}
+
+void profbeginframe()
+{
+    if(!profiling) return;
+    if(!profframes)
+    {
+        profcapacity = profileframes;
+        profframes = new profframe[profcapacity];
+        profbase = proftime();
+    }
+    profnewest = (profnewest + 1) % profcapacity;
+    proflen = min(proflen + 1, profcapacity);
+    profframe &f = profframes[profnewest];
+    f.start = f.end = proftime();
+    f.numevents = 0;
+    profdepth = 1;
+}
+
+void profendframe()
+{
+    profframe *f = curprofframe();
+    if(!f) return;
+    f->end = proftime();
+    profdepth = 0;
+}
+
+// drops the frame in progress, for loop iterations that end up idle
+void profdiscardframe()
+{
+    if(!curprofframe()) return;
+    profnewest = (profnewest + profcapacity - 1) % profcapacity;
+    proflen--;
+    profdepth = 0;
+}
+
+void profbegin(int phase)
+{
+    profframe *f = curprofframe();
+    if(!f || profdepth >= profframe::MAXEVENTS) return;
+    if(f->numevents >= profframe::MAXEVENTS) { profstack[profdepth++] = -1; return; }
+    profevent &e = f->events[f->numevents];
+    e.phase = phase;
+    e.depth = profdepth;
+    e.start = e.end = proftime();
+    profstack[profdepth++] = f->numevents++;
+}
+
+void profend(int phase)
+{
+    profframe *f = curprofframe();
+    if(!f || profdepth <= 1) return;
+    int idx = profstack[--profdepth];
+    if(idx >= 0) f->events[idx].end = proftime();
+}
+
+static const profframe &getprofframe(int i) // 0 is the newest
+{
+    return profframes[(profnewest + profcapacity - i) % profcapacity];
+}
+
+void renderprofile(int x, int y)
+{
+    if(!showprofile || !proflen) return;
+    double total[PROF_NUM], peak[PROF_NUM];
+    loopi(PROF_NUM) total[i] = peak[i] = 0;
+    int frames = 0;
+    loopi(proflen)
+    {
+        const profframe &f = getprofframe(i);
+        if(f.end <= f.start) continue;
+        double phase[PROF_NUM];
+        loopj(PROF_NUM) phase[j] = 0;
+        phase[PROF_FRAME] = (f.end - f.start)/1e6;
+        loopj(f.numevents) phase[f.events[j].phase] += (f.events[j].end - f.events[j].start)/1e6;
+        loopj(PROF_NUM) { total[j] += phase[j]; peak[j] = max(peak[j], phase[j]); }
+        frames++;
+    }
+    if(!frames) return;
+    loopi(PROF_NUM)
+    {
+        draw_textf("%-12s %7.3f ms avg %7.3f ms max", x, y, profnames[i], total[i]/frames, peak[i]);
+        y += FONTH;
+    }
+}
+
+void dumpprofile(const char *fname)
+{
+    if(!proflen) { conoutf(CON_ERROR, "no profile recorded"); return; }
+    if(!fname[0]) fname = "home/profile.json";
+    fname = path(fname, true);
+    FILE *f = fopen(fname, "w");
+    if(!f) { conoutf(CON_ERROR, "could not write %s", fname); return; }
+    fprintf(f, "{\"traceEvents\":[\n");
+    bool first = true;
+    #define TRACEEVENT(name, depth, start, end) do { \
+        fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"ragdoll\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"depth\":%d}}", \
+            first ? "" : ",\n", name, (start - profbase)/1e3, (end - start)/1e3, depth); \
+        first = false; \
+    } while(0)
+    looprevi(proflen)
+    {
+        const profframe &pf = getprofframe(i);
+        if(pf.end <= pf.start) continue;
+        TRACEEVENT(profnames[PROF_FRAME], 0, pf.start, pf.end);
+        loopj(pf.numevents)
+        {
+            const profevent &e = pf.events[j];
+            TRACEEVENT(profnames[e.phase], e.depth, e.start, e.end);
+        }
+    }
+    #undef TRACEEVENT
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(f);
+    conoutf("wrote %d frames to %s", proflen, fname);
+}
+COMMAND(dumpprofile, "s");
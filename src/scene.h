@@ -0,0 +1,89 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+// binary scene format: a header followed by typed sections, all little-endian 32-bit words
+
+#define SCENE_MAGIC "RDSCENE"
+#define SCENE_VERSION 2
+
+struct sceneheader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int num_sections;
+};
+
+struct scenesection
+{
+    unsigned int type;
+    unsigned int count;
+    unsigned int size; // payload bytes following this header, padded to 4
+};
+
+enum
+{
+    SCENE_CAMERA     = 0,
+    SCENE_SPHERES    = 1,
+    SCENE_TRIS       = 2,
+    SCENE_DIST       = 3,
+    SCENE_ROT        = 4,
+    SCENE_MODEL      = 5,
+    SCENE_JOINTS     = 6,
+    SCENE_GENERATION = 7
+};
+
+enum
+{
+    SCENE_STICKY = 1<<0,
+    SCENE_EYE    = 1<<1
+};
+
+struct scenecamera
+{
+    float origin[3];
+    float yaw, pitch;
+};
+
+struct scenesphere
+{
+    float pos[3];
+    float size;
+    unsigned int flags;
+    float saved[3][3];
+};
+
+struct scenetri
+{
+    int sphere1, sphere2, sphere3;
+};
+
+// constraints are grouped by type; index is the position in the scene's constraint list
+struct scenedist
+{
+    int index;
+    int sphere1, sphere2;
+    float dist;
+};
+
+struct scenerot
+{
+    int index;
+    int tri1, tri2;
+    float maxangle;
+    float middle[3][3];
+};
+
+struct scenemodel
+{
+    float scale;
+    // followed by the nul-terminated model name
+};
+
+struct scenejoint
+{
+    int index, tri, spheres[3];
+    float tridiff[3][4];
+};
+
+#endif
+
@@ -0,0 +1,120 @@
+// checks the vectorized and approximate paths in geom.h against reference math; run with "make test"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __FMA__
+#include <immintrin.h>
+#endif
+#include <SDL_opengl.h>
+
+#include "util.h"
+#include "geom.h"
+
+static int failures = 0;
+
+static float randf(float scale) { return (rand()/float(RAND_MAX)*2 - 1)*scale; }
+static Vec3 randvec3(float scale) { return Vec3(randf(scale), randf(scale), randf(scale)); }
+static Vec4 randvec4(float scale) { return Vec4(randf(scale), randf(scale), randf(scale), randf(scale)); }
+
+// a float dot product of n terms is within about n ulp of the exact sum of its magnitudes
+static void checkvalue(const char *what, int iter, float val, double ref, double mag)
+{
+    double err = fabs(val - ref), tolerance = 4*FLT_EPSILON*mag + FLT_MIN;
+    if(err <= tolerance) return;
+    if(failures++ < 10) printf("%s #%d: got %.9g, expected %.9g (error %g, tolerance %g)\n", what, iter, val, ref, err, tolerance);
+}
+
+// r = sum(m[i]*v[i]) over n terms
+static void checkdot(const char *what, int iter, float val, const float *m, const float *v, int n)
+{
+    double ref = 0, mag = 0;
+    loopi(n) { ref += double(m[i])*v[i]; mag += fabs(double(m[i])*v[i]); }
+    checkvalue(what, iter, val, ref, mag);
+}
+
+static void checkmatrix3x3(int iter)
+{
+    Matrix3x3 m(randvec3(1), randvec3(1), randvec3(1)), o(randvec3(1), randvec3(1), randvec3(1));
+    Vec3 p = randvec3(100);
+    const Vec3 *mrows[3] = { &m.a, &m.b, &m.c }, *orows[3] = { &o.a, &o.b, &o.c };
+
+    Matrix3x3 r = m * o;
+    const Vec3 *rrows[3] = { &r.a, &r.b, &r.c };
+    loopi(3) loopj(3)
+    {
+        float col[3] = { orows[0]->v[j], orows[1]->v[j], orows[2]->v[j] };
+        checkdot("Matrix3x3::operator*", iter, rrows[i]->v[j], mrows[i]->v, col, 3);
+    }
+
+    Vec3 t = m.transform(p), tt = m.transposedtransform(p);
+    loopi(3)
+    {
+        checkdot("Matrix3x3::transform", iter, t[i], mrows[i]->v, p.v, 3);
+        float col[3] = { m.a[i], m.b[i], m.c[i] };
+        checkdot("Matrix3x3::transposedtransform", iter, tt[i], col, p.v, 3);
+    }
+}
+
+static void checkmatrix3x4(int iter)
+{
+    Matrix3x4 m(randvec4(1), randvec4(1), randvec4(1)), o(randvec4(1), randvec4(1), randvec4(1));
+    m.a.w *= 100; m.b.w *= 100; m.c.w *= 100;
+    o.a.w *= 100; o.b.w *= 100; o.c.w *= 100;
+    Vec3 p = randvec3(100);
+    const Vec4 *mrows[3] = { &m.a, &m.b, &m.c }, *orows[3] = { &o.a, &o.b, &o.c };
+
+    Matrix3x4 r = m * o;
+    const Vec4 *rrows[3] = { &r.a, &r.b, &r.c };
+    loopi(3) loopj(4)
+    {
+        float row[4] = { mrows[i]->x, mrows[i]->y, mrows[i]->z, j==3 ? 1.0f : 0.0f },
+              col[4] = { orows[0]->v[j], orows[1]->v[j], orows[2]->v[j], j==3 ? mrows[i]->w : 0.0f };
+        checkdot("Matrix3x4::operator*", iter, rrows[i]->v[j], row, col, 4);
+    }
+
+    float p1[4] = { p.x, p.y, p.z, 1 };
+    Vec3 t = m.transform(p), tn = m.transformnormal(p), ttn = m.transposedtransformnormal(p), tt = m.transposedtransform(p);
+    Vec3 q(p.x - m.a.w, p.y - m.b.w, p.z - m.c.w);
+    loopi(3)
+    {
+        checkdot("Matrix3x4::transform", iter, t[i], mrows[i]->v, p1, 4);
+        checkdot("Matrix3x4::transformnormal", iter, tn[i], mrows[i]->v, p.v, 3);
+        float col[3] = { m.a[i], m.b[i], m.c[i] };
+        checkdot("Matrix3x4::transposedtransformnormal", iter, ttn[i], col, p.v, 3);
+        checkdot("Matrix3x4::transposedtransform", iter, tt[i], col, q.v, 3);
+    }
+}
+
+// fastnormalize must stay within this of unit length and of normalize(), over 12 orders of magnitude
+#define NORMALIZE_BOUND 3.6e-7
+
+static void checknormalize(int iter)
+{
+    Vec3 v = randvec3(1) * powf(10, randf(6));
+    if(v.dot(v) < 1e-30f) return;
+    Vec3 fast = v.fastnormalize(), exact = v.normalize();
+    double len = sqrt(double(fast.x)*fast.x + double(fast.y)*fast.y + double(fast.z)*fast.z),
+           dev = max(fabs(fast.x - exact.x), max(fabs(fast.y - exact.y), fabs(fast.z - exact.z)));
+    if(fabs(len - 1) <= NORMALIZE_BOUND && dev <= NORMALIZE_BOUND) return;
+    if(failures++ < 10) printf("Vec3::fastnormalize #%d: (%g, %g, %g) has length %.9g, deviation %g\n", iter, v.x, v.y, v.z, len, dev);
+}
+
+int main(int argc, char **argv)
+{
+    srand(1);
+    loopi(100000)
+    {
+        checkmatrix3x3(i);
+        checkmatrix3x4(i);
+    }
+    loopi(10000000) checknormalize(i);
+    if(failures) { printf("geomtest: %d failures\n", failures); return EXIT_FAILURE; }
+    printf("geomtest: ok\n");
+    return EXIT_SUCCESS;
+}
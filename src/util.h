@@ -9,6 +9,7 @@
 typedef unsigned char uchar;
 typedef unsigned short ushort;
 typedef unsigned int uint;
+typedef unsigned long long int ullong;
 
 #ifdef swap
 #undef swap